@@ -0,0 +1,344 @@
+/**
+ * @file FlashFAT_bench.cpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief Host benchmark for the FLASH FAT Library
+ * @version 0.1
+ * @date June 2022
+ * 
+ * Drives FlashFAT against the simulated chip and reports throughput, per-call latency and flash operation counts. 
+ * Latencies and throughput are in simulated chip time, cpu is the host time spent inside the library. 
+ * 
+ * Build from the repository root: 
+ *      g++ -O2 -Isrc bench/FlashFAT_bench.cpp src/FlashFAT*.cpp -o flashfat_bench 
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "FlashFAT.hpp"
+#include "FlashFAT_sim.hpp"
+
+/**
+ * @brief Benchmark settings 
+ * 
+ */
+typedef struct{
+    FlashFAT_sim_config chip;           ///< Simulated chip 
+    uint32_t log_bytes = 1048576;       ///< Bytes written per logging workload 
+    uint32_t chunk = 512;               ///< Write size for sequential logging 
+    uint32_t record = 32;               ///< Write size for small-record logging 
+    uint32_t read_chunk = 4096;         ///< Read size for readback 
+    uint32_t interval_us = 0;           ///< Host time between calls (sensor loop period) 
+    uint32_t service_us = 100;          ///< Period of service() calls while idle 
+    uint32_t files = 32;                ///< Files for the new_file/close_file workload 
+    bool tight_packing = false;         ///< Start new files on the next free page 
+    bool background_erase = false;      ///< Erase deleted files from service() 
+    uint32_t checkpoint_bytes = 0;      ///< Bytes between checkpoints while logging, 0 for none 
+    uint32_t checkpoint_ms = 0;         ///< Milliseconds between checkpoints while logging, 0 for none 
+}   bench_config; 
+
+/**
+ * @brief Results of one workload 
+ * 
+ */
+typedef struct{
+    std::vector<uint64_t> latency_ns;   ///< Simulated time per call 
+    uint64_t total_ns = 0;              ///< Simulated time for the whole workload 
+    uint64_t cpu_ns = 0;                ///< Host time inside the library 
+    uint64_t bytes = 0;                 ///< Payload bytes moved 
+    bool verified = true;               ///< Readback matched 
+}   bench_result; 
+
+static uint64_t host_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count(); 
+}
+
+static byte pattern(uint32_t i){
+    return (byte)(i * 31 + (i >> 8)); 
+}
+
+static void print_result(const char *name, bench_result &r, FlashFAT_sim_stats s){
+    std::vector<uint64_t> &l = r.latency_ns; 
+    std::sort(l.begin(), l.end()); 
+    uint64_t p50 = 0, p99 = 0, max = 0; 
+    if(!l.empty()){
+        p50 = l[l.size()/2]; 
+        p99 = l[(l.size()*99)/100]; 
+        max = l.back(); 
+    }
+    char mbps[16] = "        -"; 
+    if(r.bytes && r.total_ns) snprintf(mbps, sizeof(mbps), "%9.3f", (double)r.bytes / (double)r.total_ns * 1000.0); 
+    printf("%-16s %s MB/s  p50 %10.1f us  p99 %10.1f us  max %10.1f us  cpu %8.2f ms  "
+           "erase %6u  32k %4u  64k %4u  program %7u  read %7u  polls %10u%s\n", 
+        name, mbps, p50/1000.0, p99/1000.0, max/1000.0, r.cpu_ns/1e6, 
+        s.sector_erases, s.half_block_erases, s.block_erases, s.page_programs, s.read_commands, s.busy_polls, 
+        r.verified ? "" : "  VERIFY FAILED"); 
+    if(s.ignored_commands || s.program_conflicts){
+        printf("%-16s ignored commands %u, program conflicts %u\n", "", s.ignored_commands, s.program_conflicts); 
+    }
+}
+
+/**
+ * @brief Spend the time between calls, calling service() like a sensor loop would 
+ * 
+ */
+static void idle(bench_config &cfg, FlashFAT &fs, FlashFAT_sim &sim){
+    uint64_t end = sim.now_ns() + (uint64_t)cfg.interval_us * 1000; 
+    do{
+        fs.service(); 
+        if(sim.now_ns() < end) sim.advance(std::min<uint64_t>((uint64_t)cfg.service_us * 1000, end - sim.now_ns())); 
+    } while(sim.now_ns() < end); 
+}
+
+/**
+ * @brief Log bytes to a new file using fixed size writes 
+ * 
+ * A reserve is erased by new_file() before the clock starts 
+ * 
+ */
+static bench_result run_logging(bench_config &cfg, FlashFAT &fs, FlashFAT_sim &sim, uint32_t size, uint32_t reserve = 0){
+    bench_result r; 
+    byte *buffer = new byte[size]; 
+    fs.set_checkpoint(cfg.checkpoint_bytes, cfg.checkpoint_ms); 
+    fs.new_file(reserve); 
+    uint64_t start = sim.now_ns(); 
+    for(uint32_t written = 0; written < cfg.log_bytes; written += size){
+        uint32_t length = std::min(size, cfg.log_bytes - written); 
+        for(uint32_t i = 0; i < length; i ++) buffer[i] = pattern(written + i); 
+        idle(cfg, fs, sim); 
+        uint64_t t = sim.now_ns(); 
+        uint64_t c = host_ns(); 
+        fs.write(buffer, length); 
+        r.cpu_ns += host_ns() - c; 
+        r.latency_ns.push_back(sim.now_ns() - t); 
+        r.bytes += length; 
+    }
+    fs.close_file(); 
+    r.total_ns = sim.now_ns() - start; 
+    delete[] buffer; 
+    return r; 
+}
+
+/**
+ * @brief Read back the last file and check it 
+ * 
+ */
+static bench_result run_readback(bench_config &cfg, FlashFAT &fs, FlashFAT_sim &sim, uint fi){
+    bench_result r; 
+    byte *buffer = new byte[cfg.read_chunk]; 
+    uint64_t start = sim.now_ns(); 
+    fs.open_file(fi); 
+    uint32_t offset = 0; 
+    while(fs.peek() > 0){
+        uint64_t t = sim.now_ns(); 
+        uint64_t c = host_ns(); 
+        uint length = fs.read(buffer, cfg.read_chunk); 
+        r.cpu_ns += host_ns() - c; 
+        r.latency_ns.push_back(sim.now_ns() - t); 
+        if(length == 0) break; 
+        for(uint i = 0; i < length; i ++){
+            if(buffer[i] != pattern(offset + i)) r.verified = false; 
+        }
+        offset += length; 
+        r.bytes += length; 
+    }
+    fs.close_file(); 
+    if(offset != cfg.log_bytes) r.verified = false; 
+    r.total_ns = sim.now_ns() - start; 
+    delete[] buffer; 
+    return r; 
+}
+
+/**
+ * @brief Create and close small files, timing new_file and close_file separately 
+ * 
+ */
+static void run_files(bench_config &cfg, FlashFAT &fs, FlashFAT_sim &sim, bench_result &open, bench_result &close){
+    byte record[64]; 
+    for(uint i = 0; i < sizeof(record); i ++) record[i] = pattern(i); 
+    uint64_t start = sim.now_ns(); 
+    for(uint32_t f = 0; f < cfg.files; f ++){
+        uint64_t t = sim.now_ns(); 
+        uint64_t c = host_ns(); 
+        if(fs.new_file() != FLASHFAT_OK) break; 
+        open.cpu_ns += host_ns() - c; 
+        open.latency_ns.push_back(sim.now_ns() - t); 
+        fs.write(record, sizeof(record)); 
+        t = sim.now_ns(); 
+        c = host_ns(); 
+        fs.close_file(); 
+        close.cpu_ns += host_ns() - c; 
+        close.latency_ns.push_back(sim.now_ns() - t); 
+    }
+    open.total_ns = close.total_ns = sim.now_ns() - start; 
+}
+
+/**
+ * @brief Delete every other file of the files workload and time the service() calls of compact() 
+ * 
+ */
+static bench_result run_compaction(bench_config &cfg, FlashFAT &fs, FlashFAT_sim &sim){
+    bench_result r; 
+    FlashFAT_file_allocation_table table; 
+    fs.get_file_allocation_table(&table); 
+    for(int fi = table._num_files - 2; fi >= 0; fi -= 2) fs.delete_file(fi); 
+    sim.reset_stats(); 
+    uint64_t start = sim.now_ns(); 
+    fs.compact(); 
+    while(fs.is_compacting()){
+        uint64_t t = sim.now_ns(); 
+        uint64_t c = host_ns(); 
+        fs.service(); 
+        r.cpu_ns += host_ns() - c; 
+        r.latency_ns.push_back(sim.now_ns() - t); 
+        sim.advance((uint64_t)cfg.service_us * 1000); 
+    }
+    r.total_ns = sim.now_ns() - start; 
+    return r; 
+}
+
+static void usage(){
+    printf("usage: flashfat_bench [options]\n"
+           "  --spi-mhz N        SPI clock (default 50)\n"
+           "  --overhead-ns N    per-command overhead (default 500)\n"
+           "  --tpp-us N         page program time (default 700)\n"
+           "  --tse-us N         sector erase time (default 45000)\n"
+           "  --tbe1-us N        32kB block erase time, 0 for none (default 120000)\n"
+           "  --tbe-us N         64kB block erase time, 0 for none (default 150000)\n"
+           "  --worst-case       datasheet maximum program/erase times\n"
+           "  --tight            start new files on the next free page\n"
+           "  --background-erase erase deleted files from service()\n"
+           "  --checkpoint-kb N  kB between checkpoints while logging (default none)\n"
+           "  --checkpoint-ms N  milliseconds between checkpoints while logging (default none)\n"
+           "  --log-kb N         bytes per logging workload in kB (default 1024)\n"
+           "  --chunk N          sequential write size (default 512)\n"
+           "  --record N         small record size (default 32)\n"
+           "  --read-chunk N     readback read size (default 4096)\n"
+           "  --interval-us N    host time between write calls (default 0)\n"
+           "  --service-us N     service() period while idle (default 100)\n"
+           "  --files N          files for the new_file/close_file and compaction workloads (default 32)\n"); 
+}
+
+static bool parse(int argc, char **argv, bench_config &cfg){
+    for(int i = 1; i < argc; i ++){
+        const char *arg = argv[i]; 
+        if(strcmp(arg, "--worst-case") == 0){
+            cfg.chip.page_program_us = 3000; 
+            cfg.chip.sector_erase_us = 400000; 
+            cfg.chip.half_block_erase_us = 1600000; 
+            cfg.chip.block_erase_us = 2000000; 
+            continue; 
+        }
+        if(strcmp(arg, "--tight") == 0){
+            cfg.tight_packing = true; 
+            continue; 
+        }
+        if(strcmp(arg, "--background-erase") == 0){
+            cfg.background_erase = true; 
+            continue; 
+        }
+        if(i + 1 >= argc) return false; 
+        uint32_t value = strtoul(argv[++i], NULL, 10); 
+        if(strcmp(arg, "--spi-mhz") == 0) cfg.chip.spi_clock_hz = value * 1000000UL; 
+        else if(strcmp(arg, "--overhead-ns") == 0) cfg.chip.command_overhead_ns = value; 
+        else if(strcmp(arg, "--tpp-us") == 0) cfg.chip.page_program_us = value; 
+        else if(strcmp(arg, "--tse-us") == 0) cfg.chip.sector_erase_us = value; 
+        else if(strcmp(arg, "--tbe1-us") == 0) cfg.chip.half_block_erase_us = value; 
+        else if(strcmp(arg, "--tbe-us") == 0) cfg.chip.block_erase_us = value; 
+        else if(strcmp(arg, "--checkpoint-kb") == 0) cfg.checkpoint_bytes = value * 1024; 
+        else if(strcmp(arg, "--checkpoint-ms") == 0) cfg.checkpoint_ms = value; 
+        else if(strcmp(arg, "--log-kb") == 0) cfg.log_bytes = value * 1024; 
+        else if(strcmp(arg, "--chunk") == 0) cfg.chunk = value; 
+        else if(strcmp(arg, "--record") == 0) cfg.record = value; 
+        else if(strcmp(arg, "--read-chunk") == 0) cfg.read_chunk = value; 
+        else if(strcmp(arg, "--interval-us") == 0) cfg.interval_us = value; 
+        else if(strcmp(arg, "--service-us") == 0) cfg.service_us = value; 
+        else if(strcmp(arg, "--files") == 0) cfg.files = value; 
+        else return false; 
+    }
+    return cfg.chip.spi_clock_hz > 0 && cfg.service_us > 0 && cfg.chunk > 0 && cfg.record > 0 && cfg.read_chunk > 0; 
+}
+
+int main(int argc, char **argv){
+    bench_config cfg; 
+    if(!parse(argc, argv, cfg)){
+        usage(); 
+        return 1; 
+    }
+    printf("chip: %u MHz SPI, tPP %u us, tSE %u us, %u kB per log, %u us between writes\n", 
+        cfg.chip.spi_clock_hz / 1000000, cfg.chip.page_program_us, cfg.chip.sector_erase_us, 
+        cfg.log_bytes / 1024, cfg.interval_us); 
+
+    {
+        FlashFAT_sim sim(cfg.chip); 
+        FlashFAT fs; 
+        fs.set_tight_packing(cfg.tight_packing); 
+        fs.begin(&sim); 
+        sim.reset_stats(); 
+        bench_result r = run_logging(cfg, fs, sim, cfg.chunk); 
+        print_result("sequential", r, sim.stats()); 
+        sim.reset_stats(); 
+        r = run_readback(cfg, fs, sim, 0); 
+        print_result("readback", r, sim.stats()); 
+    }
+    {
+        FlashFAT_sim sim(cfg.chip); 
+        FlashFAT fs; 
+        fs.set_tight_packing(cfg.tight_packing); 
+        fs.begin(&sim); 
+        sim.reset_stats(); 
+        bench_result r = run_logging(cfg, fs, sim, cfg.record); 
+        print_result("small records", r, sim.stats()); 
+    }
+    {
+        FlashFAT_sim sim(cfg.chip); 
+        FlashFAT fs; 
+        fs.set_tight_packing(cfg.tight_packing); 
+        fs.begin(&sim); 
+        sim.reset_stats(); 
+        bench_result r = run_logging(cfg, fs, sim, cfg.chunk, cfg.log_bytes); 
+        print_result("reserved", r, sim.stats()); 
+    }
+    {
+        FlashFAT_sim sim(cfg.chip); 
+        FlashFAT fs; 
+        fs.set_tight_packing(cfg.tight_packing); 
+        fs.set_background_erase(cfg.background_erase); 
+        fs.begin(&sim); 
+        run_logging(cfg, fs, sim, cfg.chunk); 
+        fs.delete_all_files(); 
+        // the device sits idle before the next session 
+        do{
+            fs.service(); 
+            sim.advance((uint64_t)cfg.service_us * 1000); 
+        } while(fs.is_erasing()); 
+        sim.reset_stats(); 
+        bench_result r = run_logging(cfg, fs, sim, cfg.chunk); 
+        print_result("after delete", r, sim.stats()); 
+    }
+    {
+        FlashFAT_sim sim(cfg.chip); 
+        FlashFAT fs; 
+        fs.set_tight_packing(cfg.tight_packing); 
+        fs.begin(&sim); 
+        sim.reset_stats(); 
+        bench_result open, close; 
+        run_files(cfg, fs, sim, open, close); 
+        FlashFAT_sim_stats s = sim.stats(); 
+        print_result("new_file", open, s); 
+        print_result("close_file", close, s); 
+        bench_result r = run_compaction(cfg, fs, sim); 
+        print_result("compact service", r, sim.stats()); 
+        FlashFAT_wear_stats wear; 
+        fs.get_wear_stats(&wear); 
+        printf("%-16s erases per %u sectors min %u max %u mean %u\n", "wear", FLASH_FAT_WEAR_GROUP_SECTORS, wear.min_erases, wear.max_erases, wear.mean_erases); 
+    }
+    return 0; 
+}
@@ -1,178 +1,255 @@
 #include "FlashFAT.hpp"
 
+#ifdef ARDUINO
 FlashFAT_status_t FlashFAT::begin(int _cs){
+    scoped_lock guard(this); 
     // open the flash device 
-    W25Q64FV_status_t flash_status = _flash.begin(_cs); 
-    if(flash_status != W25Q64FV_OK) return FLASHFAT_FLASH_FAILURE; 
+    FlashFAT_device_status_t flash_status = _w25q64fv.begin(_cs); 
+    if(flash_status != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+    return begin(&_w25q64fv); 
+}
+#endif
+
+FlashFAT_status_t FlashFAT::begin(FlashFAT_device *device){
+    scoped_lock guard(this); 
+    if(device == NULL) return FLASHFAT_FLASH_FAILURE; 
+    _flash = wrap_device(device); 
+    // nothing is known erased until this object erases it 
+    memset(_erased_map, 0, sizeof(_erased_map)); 
+    memset(_erase_counts, 0, sizeof(_erase_counts)); 
     // attempt to read the FAT table 
-    FlashFAT_status_t status = get_file_allocation_table(&_table); 
+    _table_stale = true; 
+    FlashFAT_status_t status = load_file_allocation_table(); 
     if(status == FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND){
         // make the table 
-        create_file_allocation_table();
+        status = create_file_allocation_table(); 
+        if(status != FLASHFAT_OK) return status; 
+    }
+    else if(status == FLASHFAT_LEGACY_NO_SPACE){
+        // the version 1 files are still there for the caller to read out with the old library 
+        return status; 
+    }
+    else if(status == FLASHFAT_OK && _table._file_close_err != FLASH_FAT_NO_ERROR_FILE){
+        // power was lost with a file open, it stays open on the flash if it can't be journaled closed 
+        status = recover_open_file(); 
+        if(status != FLASHFAT_OK) return status; 
+    }
+    if(_flash->capacity() / 4096 > FLASH_FAT_MAX_SECTORS){
+        // usable, but everything past the maps goes to waste 
+        return FLASHFAT_CAPACITY_CLAMPED; 
     }
     return FLASHFAT_OK; 
 }
 
-FlashFAT_status_t FlashFAT::get_file_allocation_table(FlashFAT_file_allocation_table *table){
-    // read the file allocation table from the device 
-    /* 
-        The File Allocation Table is always located at the front of the device 
-        It is identified as having the prefix 'FLASHFAT' in the first 8 bytes
-        If this is not found, there is no FAT. 
-    */ 
-
-    byte buffer[256]; 
-    _flash.wait_until_free();
-    W25Q64FV_status_t status = _flash.read_page(0, buffer); 
-    if(status != W25Q64FV_OK) return FLASHFAT_FLASH_FAILURE; 
-    // read the first sequence 
-    char comp[8]; 
-    memcpy(comp, buffer, 8); 
-
-     #ifdef FLASH_FAT_SERIAL_DEBUG
-        Serial.println("FLASHFAT FAT TABLE READ: "); 
-        print_buffer(buffer, 256); 
-    #endif 
-
-    if(strncmp(comp,"FLASHFAT",8) != 0){
-        #ifdef FLASH_FAT_SERIAL_DEBUG
-            Serial.println("FLASHFAT NO FAT FOUND"); 
-        #endif 
-        return FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND; 
-    }
-    uint index = 8; 
-    table->_num_files = buffer[index]; 
-    index ++; 
-    table->_file_close_err = buffer[index]; 
-    index ++; 
-
-    for(uint i = 0; i < table->_num_files; i ++){
-        table->_files[i]._start_page = buffer[index]<<8 | buffer[index+1];
-        index += 2; 
-        table->_files[i]._page_length = buffer[index]<<8 | buffer[index+1];
-        index += 2;
-        table->_files[i]._end_offset = buffer[index]; 
-        index ++;  
+FlashFAT_status_t FlashFAT::recover_open_file(){
+    uint fi = _table._file_close_err; 
+    FlashFAT_file_entry *file = &_table._files[fi]; 
+    uint32_t start = file->_start_page * 256; 
+    uint32_t known = file->_page_length * 256 + file->_end_offset; 
+    if(_open_length > known) known = _open_length; 
+    // past the saved end there can be old data, and never past the next used sector 
+    uint32_t end_sector = known > 0 ? ((start + known - 1) >> 12) + 1 : (start >> 12) + 1; 
+    while(end_sector < sector_count() && !sector_used(end_sector)) end_sector ++; 
+    uint32_t extent = _open_extent < end_sector * 4096 ? _open_extent : end_sector * 4096; 
+    // pages before the journaled length are written, find the first erased one after 
+    uint32_t low = (start + known) >> 8; 
+    uint32_t high = extent >> 8; 
+    if(high < low) high = low; 
+    while(low < high){
+        uint32_t mid = low + (high - low) / 2; 
+        if(is_erased(mid * 256, 256)) high = mid; 
+        else low = mid + 1; 
     }
+    uint32_t length = low * 256 - start; 
+    if(length < known) length = known; 
+    else if(length > known){
+        // a checkpoint programs part of the last page, the rest of it reads as erased 
+        byte page[256]; 
+        if(_flash->read(low * 256 - 256, page, 256) == FLASHFAT_DEVICE_OK){
+            uint i = 256; 
+            while(i > 0 && page[i - 1] == 0xFF && length > known){
+                i --; 
+                length --; 
+            }
+        }
+    }
+    file->_page_length = length / 256; 
+    file->_end_offset = length % 256; 
+    _table._file_close_err = FLASH_FAT_NO_ERROR_FILE; 
+    build_sector_map(); 
+    if(fi == _table._num_files - 1U){
+        // carry on after it 
+        _allocation_cursor = (start + length + 4095) >> 12; 
+        _last_file_sectors = _allocation_cursor - (file->_start_page >> 4); 
+    }
+    return journal_file(fi); 
+}
 
-    return FLASHFAT_OK; 
-} 
-
-FlashFAT_status_t FlashFAT::write_file_allocation_table(FlashFAT_file_allocation_table *table){
-    // write the FAT table 
-    
-    // construct the buffer 
-    byte buffer[256]; 
-    // zero out the buffer 
-    memset(buffer, 0, 256); 
-    // start constructing the buffer 
-    uint index = 0; 
-    // write the 'FLASHFAT' as the first characters 
-    char prefix[] = "FLASHFAT"; 
-    memcpy(buffer, prefix, 8); 
-    index = 8; 
-    buffer[index] = table->_num_files; 
-    index ++; 
-    buffer[index] = table->_file_close_err; 
-    index ++; 
-    for(int i = 0; i < table->_num_files; i++){
-        buffer[index] = table->_files[i]._start_page >> 8; 
-        buffer[index+1] = table->_files[i]._start_page; 
-        index += 2; 
-        buffer[index] = table->_files[i]._page_length >> 8; 
-        buffer[index+1] = table->_files[i]._page_length; 
-        index += 2; 
-        buffer[index] = table->_files[i]._end_offset; 
-        index ++; 
-    }
-    // write the buffer
-    _flash.wait_until_free();  
-    _flash.enable_writing();
-    W25Q64FV_status_t flash_status = _flash.wait_until_free(); 
-    if(flash_status != W25Q64FV_OK){
-        #ifdef FLASH_FAT_SERIAL_DEBUG
-            Serial.println("FLASHFAT CHIP FAILED TO BE FREE"); 
-        #endif 
-    }
-    flash_status = _flash.erase_sector(0); 
-    if(flash_status != W25Q64FV_OK){
-        #ifdef FLASH_FAT_SERIAL_DEBUG
-            Serial.println("FLASHFAT CHIP FAILED TO ERASE"); 
-        #endif 
-    }
-    _flash.wait_until_free(); 
-    _flash.enable_writing();
-    _flash.wait_until_free();
-    flash_status = _flash.write_page(0, buffer); 
-    if(flash_status != W25Q64FV_OK){
-        #ifdef FLASH_FAT_SERIAL_DEBUG
-            Serial.println("FLASHFAT CHIP FAILED TO WRITE FAT TABLE"); 
-        #endif 
-    }
-
-    #ifdef FLASH_FAT_SERIAL_DEBUG
-        Serial.println("FLASHFAT WRITING FAT TABLE: "); 
-        print_buffer(buffer, 256); 
-    #endif 
-    return FLASHFAT_OK; 
-} 
-
-FlashFAT_status_t FlashFAT::new_file(){
+FlashFAT_status_t FlashFAT::new_file(uint32_t reserve_bytes, bool background){
+    scoped_lock guard(this); 
     // create a new file 
     // check mode 
     if(_mode != FLASHFAT_NO_MODE) return FLASHFAT_WRONG_MODE; 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
+    if(fat_status != FLASHFAT_OK) return fat_status; 
+    // the new file may take the space compaction is moving into 
+    abandon_move(); 
     // check for space 
     if(_table._num_files >= FLASH_FAT_MAX_FILE_COUNT){
         return FLASHFAT_MAX_FILE_COUNT_REACHED; 
     }
-    // find the next available address 
-    // use the next available 4kB sector 
-    uint32_t last_used_address; 
-    if(_table._num_files == 0) last_used_address = 0;
-    else{
-        last_used_address = (_table._files[_table._num_files-1]._start_page + _table._files[_table._num_files-1]._page_length) * 256 + _table._files[_table._num_files-1]._end_offset; 
+    // the file gets the largest run of free sectors, or one that holds the reserve 
+    uint32_t first_sector, end_sector; 
+    uint32_t need = reserve_bytes / 4096 + (reserve_bytes % 4096 != 0); 
+    if(!find_free_sectors(&first_sector, &end_sector, need)) return FLASHFAT_OUT_OF_SPACE; 
+    uint32_t next_start_address = first_sector * 4096; 
+    bool shared_sector = false; 
+    if(_tight_packing && _table._num_files > 0){
+        FlashFAT_file_entry *last = &_table._files[_table._num_files-1]; 
+        uint32_t last_used_address = (last->_start_page + last->_page_length) * 256 + last->_end_offset; 
+        // next page after the newest file, the rest of its sector has to still be erased to share it 
+        uint32_t next_page_address = ((last_used_address + 255) >> 8) << 8; 
+        if(last_used_address > last->_start_page * 256 && ((last_used_address - 1) >> 12) + 1 == first_sector && 
+            next_page_address < next_start_address && 
+            ((next_page_address >= _spare_erase_start && next_page_address <= _spare_erase_end) || 
+            is_erased(next_page_address, next_start_address - next_page_address))){
+            next_start_address = next_page_address; 
+            shared_sector = true; 
+        }
     }
-    // find the next 4kb address 
-    uint32_t next_start_address = ((last_used_address >> 12) + 1) << 12; 
-    // ToDo: check memory space 
+    _allocation_end = end_sector * 4096; 
+    _allocation_start = first_sector; 
+    _journaled_extent = 0; 
+    _synced_end = 0; 
+    count_free_sectors(first_sector, end_sector); 
+    _reserve_end = reserve_bytes > 0 ? next_start_address + reserve_bytes : 0; 
     _table._num_files ++; 
     _file_index = _table._num_files - 1; 
     _table._files[_file_index]._start_page = next_start_address >> 8; 
-    // erase the first 4kB to write stuff 
-    _flash.wait_until_free(); 
-    _flash.erase_sector(next_start_address); 
-    _erase_index = next_start_address + 4095; 
+    if(next_start_address >= _spare_erase_start && next_start_address <= _spare_erase_end){
+        // already erased ahead by the last file, programmed without erase_next_sector() so the map has to forget it 
+        for(uint32_t sector = next_start_address >> 12; sector <= _spare_erase_end >> 12; sector ++) set_sector_erased(sector, false); 
+        _erase_index = _spare_erase_end; 
+    }
+    else if(shared_sector){
+        // rest of the sector checked erased above, start erasing at the next one 
+        _erase_index = next_start_address | 4095; 
+    }
+    else if(_erase_ahead > 0){
+        // leave the erase to service() 
+        _erase_index = next_start_address - 1; 
+    }
+    else{
+        // erase the first 4kB to write stuff, the block choice goes by the length written so far 
+        _flash->wait_until_free(); 
+        _erase_index = next_start_address - 1; 
+        _current_index = next_start_address; 
+        if(erase_next_sector() != FLASHFAT_OK){
+            // nothing journaled yet, the file was never there 
+            _table._num_files --; 
+            _reserve_end = 0; 
+            count_free_sectors(0, 0); 
+            return FLASHFAT_FLASH_FAILURE; 
+        }
+    }
+    _spare_erase_end = 0; 
     _current_index = next_start_address; 
+    _checkpoint_end = next_start_address; 
+    _checkpoint_time = _flash->time_ms(); 
     // set the error flag 
     _table._file_close_err = _file_index; 
+    _table._files[_file_index]._page_length = 0; 
+    _table._files[_file_index]._end_offset = 0; 
     // write the FAT table 
     _mode = FLASHFAT_WRITE_MODE; 
-    return write_file_allocation_table(&_table); 
+    FlashFAT_status_t status = journal_file(_file_index); 
+    if(status != FLASHFAT_OK || reserve_bytes == 0 || background) return status; 
+    // erase the reserve now, writes up to it only program 
+    while(_erase_index + 1 < _reserve_end){
+        _flash->wait_until_free(); 
+        if(erase_next_sector() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+    }
+    // and the standby journal, service() would erase it while logging 
+    while(_standby_erased < FLASH_FAT_JOURNAL_SECTORS){
+        _flash->wait_until_free(); 
+        if(erase_journal_standby() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+    }
+    _flash->wait_until_free(); 
+    return FLASHFAT_OK; 
+}
+
+FlashFAT_status_t FlashFAT::open_file(uint fi, FlashFAT_File *file){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return FLASHFAT_FLASH_FAILURE; 
+    file->close(); 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
+    if(fat_status != FLASHFAT_OK) return fat_status; 
+    if(_table._num_files <= fi) return FLASHFAT_INVALID_FILE; 
+    // the file can't move or be erased while the handle is open, the length is fixed 
+    file->_fs = this; 
+    file->_writing = false; 
+    file->_start = _table._files[fi]._start_page * 256; 
+    file->_end = file->_start + _table._files[fi]._page_length * 256 + _table._files[fi]._end_offset; 
+    file->_position = 0; 
+    _open_handles ++; 
+    return FLASHFAT_OK; 
+}
+
+FlashFAT_status_t FlashFAT::new_file(FlashFAT_File *file, uint32_t reserve_bytes, bool background){
+    scoped_lock guard(this); 
+    if(_mode != FLASHFAT_NO_MODE) return FLASHFAT_WRONG_MODE; 
+    file->close(); 
+    FlashFAT_status_t status = new_file(reserve_bytes, background); 
+    // the file is open from here even if the reserve failed to erase 
+    if(_mode != FLASHFAT_WRITE_MODE) return status; 
+    file->_fs = this; 
+    file->_writing = true; 
+    file->_start = _table._files[_file_index]._start_page * 256; 
+    _writer = file; 
+    file->_end = file->_start; 
+    file->_position = 0; 
+    return status; 
 }
 
 FlashFAT_status_t FlashFAT::close_file(){
+    scoped_lock guard(this); 
+    FlashFAT_status_t record_status = FLASHFAT_OK; 
     // close out the file 
     // close out the remaining buffer 
     if(_mode == FLASHFAT_WRITE_MODE){
-        
+        #if FLASH_FAT_RING_BUFFER > 0
+            // bytes queued before the close go in the file, the tail may pass ring_end 
+            FlashFAT_ring_index_t ring_end = __atomic_load_n(&_ring_head, __ATOMIC_ACQUIRE); 
+            while(_ring_tail != ring_end && (FlashFAT_ring_index_t)(ring_end - _ring_tail) <= FLASH_FAT_RING_BUFFER){
+                _flash->wait_until_free(); 
+                FlashFAT_status_t ring_status = service(); 
+                if(ring_status != FLASHFAT_OK) return ring_status; 
+            }
+        #endif
+        // finish the full buffers first 
+        FlashFAT_status_t flush_status = flush_write_buffers(); 
+        if(flush_status != FLASHFAT_OK) return flush_status; 
+        byte *write_buffer = _write_buffers[_fill_buffer]; 
         if(_write_buffer_index != 0){
             // fill up the rest of the buffer as '255'
-            memset(&_write_buffer[_write_buffer_index], 255, FLASH_FAT_FILE_BUFFER - _write_buffer_index); 
-            // write the buffer 
-            // check the erase 
-            if(_current_index + FLASH_FAT_FILE_BUFFER > _erase_index){
-                // need to erase more 
-                _flash.erase_sector(_erase_index+1); 
-                // update erase index 
-                _erase_index += 4096; 
-            }
+            memset(&write_buffer[_write_buffer_index], 255, FLASH_FAT_FILE_BUFFER - _write_buffer_index); 
             // check how many pages to write 
             uint pages_to_write = (_write_buffer_index + 255)/256; 
-            // Serial.print("Pages to write: ");
-            // Serial.println(pages_to_write);
             // write the page 
             for(uint p = 0; p < pages_to_write; p ++){
                 // wait until free 
+                _flash->wait_until_free(); 
+                // check the erase 
+                if(_current_index + 255 > _erase_index){
+                    // need to erase more 
+                    if(erase_next_sector() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+                    _flash->wait_until_free(); 
+                }
+                if(_current_index + 256 > _journaled_extent){
+                    // recovery has to know the page may be written 
+                    if(journal_progress() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+                    _flash->wait_until_free(); 
+                }
                 uint bytes_to_write = 256; 
                 if(p == pages_to_write - 1){
                     // check how much to actually write 
@@ -183,87 +260,392 @@ FlashFAT_status_t FlashFAT::close_file(){
                         // not really clean, should revisit 
                         bytes_to_write = 256; 
                     }
-                    // Serial.print("Bytes to write: "); 
-                    // Serial.println(bytes_to_write);
                 }
-                _flash.wait_until_free(); 
-                _flash.enable_writing(); 
-                _flash.wait_until_free();
-                W25Q64FV_status_t status = _flash.write_page(_current_index, &_write_buffer[p*256]); 
-                if(status != W25Q64FV_OK) return FLASHFAT_FLASH_FAILURE; 
+                FlashFAT_device_status_t status = _flash->write_page(_current_index, &write_buffer[p*256]); 
+                if(status != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
                 _current_index += bytes_to_write; 
             }
         }
+        // remember what the erase ahead left behind for the next file 
+        _spare_erase_start = ((_current_index + 255) >> 8) << 8; 
+        _spare_erase_end = _erase_index; 
         // close out the FAT 
-        // Serial.print("End Address: "); 
-        // Serial.println(_current_index); 
-        // Serial.print("Start Address: ");
-        // Serial.println(_table._files[_file_index]._start_page * 256); 
-
         _table._file_close_err = FLASH_FAT_NO_ERROR_FILE; 
         _table._files[_file_index]._page_length = (_current_index)/256 - _table._files[_file_index]._start_page; 
         _table._files[_file_index]._end_offset = _write_buffer_index%256; // not 100% sure about this? 
-        // Serial.print("Page Length: "); 
-        // Serial.println(_table._files[_file_index]._page_length);
-        write_file_allocation_table(&_table); 
+        mark_sectors(_table._files[_file_index]._start_page * 256, _current_index); 
+        _used_bytes += _current_index - _table._files[_file_index]._start_page * 256; 
+        count_free_sectors(0, 0); 
+        // the next file is tried after this one 
+        _allocation_cursor = (_current_index + 4095) >> 12; 
+        _last_file_sectors = _allocation_cursor - (_table._files[_file_index]._start_page >> 4); 
+        // closed either way, a failed record leaves the table to be rewritten by the next change 
+        record_status = journal_file(_file_index); 
+        if(_unsaved_erases >= FLASH_FAT_WEAR_SAVE_ERASES){
+            FlashFAT_status_t wear_status = journal_wear(); 
+            if(record_status == FLASHFAT_OK) record_status = wear_status; 
+        }
         // set the mode 
     }
     _mode = FLASHFAT_NO_MODE; 
     _write_buffer_index = 0; 
+    _fill_buffer = 0; 
+    _flush_buffer = 0; 
+    _flush_page = 0; 
+    _queued_buffers = 0; 
     _file_index = 0; 
     _erase_index = 0; 
     _current_index = 0; 
-    return FLASHFAT_OK; 
+    _reserve_end = 0; 
+    _journaled_extent = 0; 
+    // the write handle goes with the file 
+    if(_writer != NULL) _writer->_fs = NULL; 
+    _writer = NULL; 
+    return record_status; 
 }
 
-
-
 FlashFAT_status_t FlashFAT::write(byte *buffer, uint length){
+    scoped_lock guard(this); 
     // check the mode 
     if(_mode != FLASHFAT_WRITE_MODE) return FLASHFAT_WRONG_MODE; 
-    // use a buffer to handle all writing operations 
-
-    for(uint i = 0; i < length; i ++){
-        // add to the master buffer 
-        _write_buffer[_write_buffer_index] = buffer[0]; 
-        _write_buffer_index ++;
-        *buffer++;  
-        // check sizing 
-        if(_write_buffer_index >= FLASH_FAT_FILE_BUFFER){
-            // write operations 
-            // check the erase 
-            if(_current_index + FLASH_FAT_FILE_BUFFER > _erase_index){
+    // the file can't grow into the next used sector or off the end of the chip, compared without overflowing 
+    if(length > _allocation_end - write_end()) return FLASHFAT_OUT_OF_SPACE; 
+    // more than the buffers can hold would block on the flash anyway, program whole pages straight from the caller 
+    if(_write_buffer_index == 0 && _queued_buffers == 0 && length > FLASH_FAT_FILE_BUFFER * FLASH_FAT_WRITE_BUFFER_COUNT){
+        while(length >= 256){
+            _flash->wait_until_free(); 
+            if(_current_index + 255 > _erase_index){
                 // need to erase more 
-                _flash.erase_sector(_erase_index+1); 
-                // update erase index 
-                _erase_index += 4096; 
+                if(erase_next_sector() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+                continue; 
             }
-            // check how many pages to write 
-            uint pages_to_write = FLASH_FAT_FILE_BUFFER/256; 
-            // write the page 
-            for(uint p = 0; p < pages_to_write; p ++){
-                // wait until free 
-                _flash.wait_until_free(); 
-                _flash.enable_writing(); 
-                _flash.wait_until_free(); 
-                _flash.write_page(_current_index, &_write_buffer[p * 256]); 
-                _current_index += 256; 
+            if(_current_index + 256 > _journaled_extent){
+                // recovery has to know the page may be written 
+                if(journal_progress() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+                continue; 
             }
-            // reset the index 
+            if(_flash->write_page(_current_index, buffer) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+            _current_index += 256; 
+            buffer += 256; 
+            length -= 256; 
+        }
+    }
+    // fill the current buffer, full buffers are handed to service() 
+    while(length > 0){
+        // service() can leave every buffer queued with bytes from enqueue() 
+        while(_queued_buffers >= FLASH_FAT_WRITE_BUFFER_COUNT){
+            _flash->wait_until_free(); 
+            FlashFAT_status_t status = service(); 
+            if(status != FLASHFAT_OK) return status; 
+        }
+        uint space = FLASH_FAT_FILE_BUFFER - _write_buffer_index; 
+        uint chunk = length < space ? length : space; 
+        memcpy(&_write_buffers[_fill_buffer][_write_buffer_index], buffer, chunk); 
+        _write_buffer_index += chunk; 
+        buffer += chunk; 
+        length -= chunk; 
+        if(_write_buffer_index >= FLASH_FAT_FILE_BUFFER){
+            // queue the buffer 
+            _queued_buffers ++; 
+            _fill_buffer = (_fill_buffer + 1) % FLASH_FAT_WRITE_BUFFER_COUNT; 
             _write_buffer_index = 0; 
+            // every buffer is waiting on the flash, have to block 
+            while(_queued_buffers >= FLASH_FAT_WRITE_BUFFER_COUNT){
+                _flash->wait_until_free(); 
+                FlashFAT_status_t status = service(); 
+                if(status != FLASHFAT_OK) return status; 
+            }
+        }
+    }
+    // start any work that can go now 
+    return service(); 
+}
+
+FlashFAT_status_t FlashFAT::service(){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return FLASHFAT_OK; 
+    if(_mode == FLASHFAT_READ_MODE) return erase_journal_standby(); 
+    if(_mode == FLASHFAT_NO_MODE){
+        // standby journal first, then compaction gets whatever time is left 
+        FlashFAT_status_t status = erase_journal_standby(); 
+        if(status != FLASHFAT_OK) return status; 
+        // compaction moves into what the background erase leaves behind 
+        if(is_erasing()) return free_erase_step(); 
+        return compact_step(); 
+    }
+    #if FLASH_FAT_RING_BUFFER > 0
+        // bytes from enqueue() go in ahead of the page programs 
+        drain_ring(); 
+    #endif
+    // one flash operation per free check, never waits 
+    while(_queued_buffers > 0){
+        if(_flash->is_busy()) return FLASHFAT_OK; 
+        // check the erase 
+        if(_current_index + 255 > _erase_index){
+            // need to erase more 
+            if(erase_next_sector() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+            continue; 
+        }
+        if(_current_index + 256 > _journaled_extent){
+            // recovery has to know the page may be written, a full journal waits for its standby area 
+            if(!progress_ready()) return erase_journal_standby(); 
+            if(journal_progress() != FLASHFAT_OK) return FLASHFAT_FLASH_FAILURE; 
+            continue; 
+        }
+        // program the next page of the oldest buffer 
+        FlashFAT_device_status_t status = _flash->write_page(_current_index, &_write_buffers[_flush_buffer][_flush_page * 256]); 
+        if(status != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+        _current_index += 256; 
+        _flush_page ++; 
+        if(_flush_page >= FLASH_FAT_FILE_BUFFER/256){
+            // buffer is done, free it up 
+            _flush_page = 0; 
+            _flush_buffer = (_flush_buffer + 1) % FLASH_FAT_WRITE_BUFFER_COUNT; 
+            _queued_buffers --; 
         }
     }
+    // everything up to the buffer being filled is programmed 
+    if(checkpoint_due()) return checkpoint_step(); 
+    // nothing to program, keep the erase ahead of the write cursor 
+    uint32_t erase_target = (_current_index | 4095) + _erase_ahead * 4096; 
+    // inside a reserve erase all of it and nothing past it 
+    if(_current_index < _reserve_end) erase_target = _reserve_end - 1; 
+    if(_erase_index < erase_target && _erase_index + 1 < _allocation_end){
+        if(_flash->is_busy()) return FLASHFAT_OK; 
+        return erase_next_sector(); 
+    }
+    // get the standby FAT journal ready for the next table rewrite 
+    return erase_journal_standby(); 
+}
+
+void FlashFAT::set_erase_ahead(uint sectors){
+    scoped_lock guard(this); 
+    _erase_ahead = sectors; 
+}
+
+void FlashFAT::set_checkpoint(uint32_t bytes, uint32_t ms){
+    scoped_lock guard(this); 
+    _checkpoint_bytes = bytes; 
+    _checkpoint_ms = ms; 
+}
+
+bool FlashFAT::checkpoint_due(){
+    uint32_t end = write_end(); 
+    if(end <= _checkpoint_end) return false; 
+    if(_checkpoint_bytes > 0 && end - _checkpoint_end >= _checkpoint_bytes) return true; 
+    return _checkpoint_ms > 0 && _flash->time_ms() - _checkpoint_time >= _checkpoint_ms; 
+}
+
+FlashFAT_status_t FlashFAT::checkpoint_step(){
+    if(_flash->is_busy()) return FLASHFAT_OK; 
+    uint32_t end = write_end(); 
+    if(_synced_end < end){
+        // page with the first byte not programmed yet 
+        uint32_t page = _synced_end > _current_index ? _synced_end & ~(uint32_t)255 : _current_index; 
+        if(page + 255 > _erase_index) return erase_next_sector(); 
+        if(page + 256 > _journaled_extent) return progress_ready() ? journal_progress() : erase_journal_standby(); 
+        // the rest of the page programs as erased, it is programmed again once filled 
+        byte *write_buffer = _write_buffers[_fill_buffer]; 
+        memset(&write_buffer[_write_buffer_index], 255, FLASH_FAT_FILE_BUFFER - _write_buffer_index); 
+        if(_flash->write_page(page, &write_buffer[page - _current_index]) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+        _synced_end = page + 256 < end ? page + 256 : end; 
+        return FLASHFAT_OK; 
+    }
+    if(!progress_ready()) return erase_journal_standby(); 
+    FlashFAT_status_t status = journal_progress(); 
+    if(status != FLASHFAT_OK) return status; 
+    _checkpoint_end = end; 
+    _checkpoint_time = _flash->time_ms(); 
+    return FLASHFAT_OK; 
+}
+
+void FlashFAT::set_tight_packing(bool tight){
+    scoped_lock guard(this); 
+    _tight_packing = tight; 
+}
+
+void FlashFAT::set_background_erase(bool enable){
+    scoped_lock guard(this); 
+    _background_erase = enable; 
+    if(!enable) _free_erase_end = _free_erase_sector; 
+}
+
+bool FlashFAT::is_erasing(){
+    scoped_lock guard(this); 
+    return _free_erase_sector < _free_erase_end; 
+}
+
+FlashFAT_device_status_t FlashFAT::erase_sector(uint32_t address){
+    FlashFAT_device_status_t status = _flash->erase_sector(address); 
+    if(status == FLASHFAT_DEVICE_OK){
+        uint32_t group = (address >> 12) / FLASH_FAT_WEAR_GROUP_SECTORS; 
+        if(group < FLASH_FAT_WEAR_GROUPS) _erase_counts[group] ++; 
+        _unsaved_erases ++; 
+    }
+    return status; 
+}
+
+FlashFAT_device_status_t FlashFAT::erase_block(uint32_t address, uint32_t size){
+    FlashFAT_device_status_t status = size == FLASH_FAT_BLOCK_SIZE ? _flash->erase_block(address) : _flash->erase_half_block(address); 
+    if(status == FLASHFAT_DEVICE_OK){
+        // every sector in the block takes the wear 
+        for(uint32_t sector = address >> 12; sector < (address + size) >> 12; sector ++){
+            uint32_t group = sector / FLASH_FAT_WEAR_GROUP_SECTORS; 
+            if(group < FLASH_FAT_WEAR_GROUPS) _erase_counts[group] ++; 
+        }
+        _unsaved_erases += size / 4096; 
+    }
+    return status; 
+}
+
+FlashFAT_status_t FlashFAT::free_erase_step(){
+    if(!is_erasing()) return FLASHFAT_OK; 
+    if(_flash->is_busy()) return FLASHFAT_OK; 
+    // sectors are marked erased when the erase starts, the next call steps over them once the flash is free 
+    while(_free_erase_sector < _free_erase_end){
+        uint32_t sector = _free_erase_sector; 
+        if(sector_used(sector) || sector_erased(sector)){
+            _free_erase_sector ++; 
+            continue; 
+        }
+        // a whole free block goes in one erase 
+        uint32_t block_sectors = FLASH_FAT_BLOCK_SIZE / 4096; 
+        bool whole_block = sector % block_sectors == 0 && sector + block_sectors <= _free_erase_end; 
+        for(uint32_t s = sector; whole_block && s < sector + block_sectors; s ++) whole_block = !sector_used(s); 
+        if(whole_block){
+            FlashFAT_device_status_t status = erase_block(sector * 4096, FLASH_FAT_BLOCK_SIZE); 
+            if(status == FLASHFAT_DEVICE_OK){
+                for(uint32_t s = sector; s < sector + block_sectors; s ++) set_sector_erased(s, true); 
+                return FLASHFAT_OK; 
+            }
+            if(status != FLASHFAT_DEVICE_UNSUPPORTED) return FLASHFAT_FLASH_FAILURE; 
+        }
+        if(erase_sector(sector * 4096) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+        set_sector_erased(sector, true); 
+        return FLASHFAT_OK; 
+    }
+    // all done, save the map so files after a power cycle skip these erases too 
+    return journal_erased(); 
+}
+
+FlashFAT_status_t FlashFAT::erase_next_sector(){
+    uint32_t sector = (_erase_index + 1) >> 12; 
+    // a reserved or already long file is likely to fill the block, one block erase is much faster than its sectors 
+    uint32_t written = _current_index - _table._files[_file_index]._start_page * 256; 
+    for(uint32_t size = FLASH_FAT_BLOCK_SIZE; size >= FLASH_FAT_HALF_BLOCK_SIZE; size /= 2){
+        uint32_t block_sectors = size / 4096; 
+        if(written < size && (sector + block_sectors) * 4096 > _reserve_end) continue; 
+        if(sector % block_sectors != 0 || (sector + block_sectors) * 4096 > _allocation_end) continue; 
+        bool erased = false; 
+        for(uint32_t s = sector; s < sector + block_sectors; s ++) erased |= sector_erased(s); 
+        if(erased) continue; 
+        FlashFAT_device_status_t status = erase_block(sector * 4096, size); 
+        if(status == FLASHFAT_DEVICE_UNSUPPORTED) continue; 
+        if(status != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+        _erase_index += size; 
+        return FLASHFAT_OK; 
+    }
+    // compaction may have erased it already 
+    if(!sector_erased(sector)){
+        if(erase_sector(_erase_index + 1) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE; 
+    }
+    // the file is about to write into it 
+    set_sector_erased(sector, false); 
+    _erase_index += 4096; 
+    return FLASHFAT_OK; 
+}
+
+FlashFAT_status_t FlashFAT::get_wear_stats(FlashFAT_wear_stats *stats){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return FLASHFAT_FLASH_FAILURE; 
+    uint32_t groups = (sector_count() + FLASH_FAT_WEAR_GROUP_SECTORS - 1) / FLASH_FAT_WEAR_GROUP_SECTORS; 
+    stats->min_erases = 0xFFFFFFFF; 
+    stats->max_erases = 0; 
+    stats->total_erases = 0; 
+    for(uint32_t i = 0; i < groups; i ++){
+        // dividing down to sectors would show a chip with less than an erase per sector as unworn 
+        uint32_t erases = _erase_counts[i]; 
+        if(erases < stats->min_erases) stats->min_erases = erases; 
+        if(erases > stats->max_erases) stats->max_erases = erases; 
+        stats->total_erases += _erase_counts[i]; 
+    }
+    if(groups == 0) stats->min_erases = 0; 
+    stats->mean_erases = groups > 0 ? (stats->total_erases + groups / 2) / groups : 0; 
+    return FLASHFAT_OK; 
+}
+
+uint32_t FlashFAT::free_bytes(){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return 0; 
+    load_file_allocation_table(); 
+    uint32_t free = _free_sectors; 
+    if(_mode == FLASHFAT_WRITE_MODE){
+        // sectors the open file has started on are taken 
+        uint32_t end_sector = (write_end() + 4095) >> 12; 
+        if(end_sector > _allocation_start) free -= end_sector - _allocation_start; 
+    }
+    return free * 4096; 
+}
+
+uint32_t FlashFAT::used_bytes(){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return 0; 
+    load_file_allocation_table(); 
+    if(_mode == FLASHFAT_WRITE_MODE) return _used_bytes + write_end() - _table._files[_file_index]._start_page * 256; 
+    return _used_bytes; 
+}
+
+uint32_t FlashFAT::largest_contiguous_free(){
+    scoped_lock guard(this); 
+    if(_flash == NULL) return 0; 
+    load_file_allocation_table(); 
+    uint32_t largest = _largest_free * 4096; 
+    if(_mode == FLASHFAT_WRITE_MODE){
+        // what's left of the open file's run 
+        uint32_t left = _allocation_end - (((write_end() + 4095) >> 12) << 12); 
+        if(left > largest) largest = left; 
+    }
+    return largest; 
+}
+
+uint32_t FlashFAT::write_end(){
+    return _current_index + _queued_buffers * FLASH_FAT_FILE_BUFFER - _flush_page * 256 + _write_buffer_index; 
+}
+
+bool FlashFAT::is_erased(uint32_t address, uint32_t length){
+    byte page[256]; 
+    _flash->wait_until_free(); 
+    while(length > 0){
+        uint chunk = length < 256 ? length : 256; 
+        if(_flash->read(address, page, chunk) != FLASHFAT_DEVICE_OK) return false; 
+        for(uint i = 0; i < chunk; i ++){
+            if(page[i] != 0xFF) return false; 
+        }
+        address += chunk; 
+        length -= chunk; 
+    }
+    return true; 
+}
+
+FlashFAT_status_t FlashFAT::flush_write_buffers(){
+    while(_queued_buffers > 0){
+        _flash->wait_until_free(); 
+        FlashFAT_status_t status = service(); 
+        if(status != FLASHFAT_OK) return status; 
+    }
+    _flash->wait_until_free(); 
     return FLASHFAT_OK; 
 }
 
 FlashFAT_status_t FlashFAT::open_file(uint fi){
+    scoped_lock guard(this); 
     // check the mode 
     if(_mode != FLASHFAT_NO_MODE){
         // bad situation, error out 
         return FLASHFAT_WRONG_MODE; 
     }
-    // update the table 
-    FlashFAT_status_t fat_status = get_file_allocation_table(&_table);
+    // the cached table is current unless it was invalidated 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
     if(fat_status != FLASHFAT_OK){
         return fat_status; 
     }
@@ -290,42 +672,61 @@ FlashFAT_status_t FlashFAT::open_file(uint fi){
 }
 
 uint FlashFAT::read(byte *buffer, uint length){
-    // check the mode 
-    if(_mode != FLASHFAT_READ_MODE) return FLASHFAT_WRONG_MODE; 
+    scoped_lock guard(this); 
+    // a status would pass for a byte count, nothing is read outside READ_MODE 
+    if(_mode != FLASHFAT_READ_MODE) return 0; 
+    uint read_length = pread(tell(), buffer, length); 
+    _current_index += read_length; 
+    return read_length; 
+}
+
+uint FlashFAT::pread(uint32_t offset, byte *buffer, uint length){
+    scoped_lock guard(this); 
+    if(_mode != FLASHFAT_READ_MODE) return 0; 
+    return read_at(_table._files[_file_index]._start_page * 256, _end_index, offset, buffer, length); 
+}
+
+uint FlashFAT::read_at(uint32_t start, uint32_t end, uint32_t offset, byte *buffer, uint length){
     // check there is actually more to read 
-    if(peek() == 0) return 0; 
+    if(offset >= end - start) return 0; 
+    uint32_t address = start + offset; 
     // check the size 
-    if(_current_index + length > _end_index){
+    if(length > end - address){
         // adjust length 
-        length = _end_index - _current_index; 
+        length = end - address; 
     }
-    uint length_to_read = length; 
-    // do a circular read on the contents 
-    byte read_buffer[256]; 
-    memset(read_buffer,0,256);
-    uint pages_req = (length/256 + 0.5); 
-    while(length > 0){
-        // read a page 
-        
-        W25Q64FV_status_t status = _flash.read_page(_current_index, read_buffer);
-        _current_index += length; 
-        if(status != W25Q64FV_OK) return 0; 
-        // increment 
-        if(length > 255){
-            memcpy(buffer, read_buffer, 256); 
-            buffer += 256; 
-            length -=256; 
-        } 
-        else{
-            memcpy(buffer, read_buffer, length); 
-            buffer += length; 
-            length = 0; 
-        }
+    // only touches the flash, a FlashFAT_locked device lets other tasks in between chunks 
+    for(uint done = 0; done < length; ){
+        uint chunk = length - done < FLASH_FAT_READ_CHUNK ? length - done : FLASH_FAT_READ_CHUNK; 
+        // a program or erase started by service() may still be going 
+        _flash->wait_until_free(); 
+        // one continuous read straight into the caller's buffer 
+        FlashFAT_device_status_t status = _flash->read(address + done, buffer + done, chunk); 
+        if(status != FLASHFAT_DEVICE_OK) return 0; 
+        done += chunk; 
     }
-    return length_to_read; //TODO sometime I should fix this   
+    return length; 
+}
+
+FlashFAT_status_t FlashFAT::seek(uint32_t offset){
+    scoped_lock guard(this); 
+    if(_mode != FLASHFAT_READ_MODE) return FLASHFAT_WRONG_MODE; 
+    uint32_t start = _table._files[_file_index]._start_page * 256; 
+    if(offset > _end_index - start) return FLASHFAT_INVALID_OFFSET; 
+    _current_index = start + offset; 
+    return FLASHFAT_OK; 
+}
+
+uint32_t FlashFAT::tell(){
+    scoped_lock guard(this); 
+    uint32_t start = _table._files[_file_index]._start_page * 256; 
+    if(_mode == FLASHFAT_READ_MODE) return _current_index - start; 
+    if(_mode == FLASHFAT_WRITE_MODE) return write_end() - start; 
+    return 0; 
 }
 
 uint FlashFAT::peek(){
+    scoped_lock guard(this); 
     // return the remaining file size 
     if(_mode != FLASHFAT_READ_MODE) return 0; 
     // calculate the remaining file length 
@@ -338,37 +739,229 @@ uint FlashFAT::peek(){
     return remaining; 
 }
 
+FlashFAT_status_t FlashFAT::delete_file(uint fi){
+    scoped_lock guard(this); 
+    if(_mode != FLASHFAT_NO_MODE || _open_handles > 0) return FLASHFAT_WRONG_MODE; 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
+    if(fat_status != FLASHFAT_OK) return fat_status; 
+    if(fi >= _table._num_files) return FLASHFAT_INVALID_FILE; 
+    abandon_move(); 
+    if(_background_erase){
+        // queue the sectors of the file, shared ones are skipped once the map is rebuilt 
+        FlashFAT_file_entry *file = &_table._files[fi]; 
+        uint32_t first = file->_start_page >> 4; 
+        uint32_t end = ((file->_start_page + file->_page_length) * 256 + file->_end_offset + 4095) >> 12; 
+        if(!is_erasing()){
+            _free_erase_sector = first; 
+            _free_erase_end = end; 
+        }
+        if(first < _free_erase_sector) _free_erase_sector = first; 
+        if(end > _free_erase_end) _free_erase_end = end; 
+    }
+    // move the later files down 
+    for(uint i = fi; i + 1 < _table._num_files; i ++) _table._files[i] = _table._files[i + 1]; 
+    _table._num_files --; 
+    if(_table._file_close_err == fi) _table._file_close_err = FLASH_FAT_NO_ERROR_FILE; 
+    else if(_table._file_close_err != FLASH_FAT_NO_ERROR_FILE && _table._file_close_err > fi) _table._file_close_err --; 
+    // sectors shared with a neighbour stay used 
+    build_sector_map(); 
+    return journal_delete(fi); 
+}
+
 FlashFAT_status_t FlashFAT::delete_last_file(){
+    scoped_lock guard(this); 
     // decrease the page count by one 
     // check the mode 
     if(_mode != FLASHFAT_NO_MODE) return FLASHFAT_INVALID_FILE; 
+    // open handles read files where they are 
+    if(_open_handles > 0) return FLASHFAT_WRONG_MODE; 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
+    if(fat_status != FLASHFAT_OK) return fat_status; 
     // decrease the file count 
     if(_table._num_files > 0) _table._num_files --; 
-    return write_file_allocation_table(&_table); 
+    abandon_move(); 
+    build_sector_map(); 
+    return journal_count(); 
 }
 
 FlashFAT_status_t FlashFAT::delete_all_files(){
+    scoped_lock guard(this); 
     // decrease the page count by one 
     // check the mode 
     if(_mode != FLASHFAT_NO_MODE) return FLASHFAT_INVALID_FILE; 
+    // open handles read files where they are 
+    if(_open_handles > 0) return FLASHFAT_WRONG_MODE; 
+    FlashFAT_status_t fat_status = load_file_allocation_table(); 
+    if(fat_status != FLASHFAT_OK) return fat_status; 
     // decrease the file count 
     _table._num_files = 0; 
-    return write_file_allocation_table(&_table); 
+    abandon_move(); 
+    build_sector_map(); 
+    if(_background_erase){
+        // service() erases the whole data area 
+        _free_erase_sector = FLASH_FAT_DATA_START / 4096; 
+        _free_erase_end = sector_count(); 
+    }
+    FlashFAT_status_t status = journal_count(); 
+    if(status != FLASHFAT_OK) return status; 
+    // keep the allocation cursor, the next file carries on where the last one ended 
+    return journal_wear(); 
 }
 
 
 FlashFAT_status_t FlashFAT::create_file_allocation_table(){
+    scoped_lock guard(this); 
+    // handles would read or write whatever comes after 
+    if(_open_handles > 0 || _writer != NULL) return FLASHFAT_WRONG_MODE; 
     // create a blank FAT table 
     _table._num_files = 0; 
-    return write_file_allocation_table(&_table); 
+    _table._file_close_err = FLASH_FAT_NO_ERROR_FILE; 
+    _table_stale = false; 
+    abandon_move(); 
+    build_sector_map(); 
+    return rewrite_table(); 
 }
 
+FlashFAT_status_t FlashFAT::get_file_allocation_table(FlashFAT_file_allocation_table *table){
+    scoped_lock guard(this); 
+    FlashFAT_status_t status = load_file_allocation_table(); 
+    if(status != FLASHFAT_OK) return status; 
+    // copy out of the cache 
+    memcpy(table, &_table, sizeof(_table)); 
+    return FLASHFAT_OK; 
+}
+
+FlashFAT_status_t FlashFAT::invalidate_file_allocation_table(){
+    scoped_lock guard(this); 
+    // open handles read files where the cached table put them 
+    if(_mode != FLASHFAT_NO_MODE || _open_handles > 0) return FLASHFAT_WRONG_MODE; 
+    abandon_move(); 
+    _table_stale = true; 
+    _table_dirty = false; 
+    return FLASHFAT_OK; 
+}
 
+FlashFAT_status_t FlashFAT::load_file_allocation_table(){
+    if(!_table_stale) return FLASHFAT_OK; 
+    FlashFAT_status_t status = read_file_allocation_table(&_table); 
+    if(status == FLASHFAT_OK){
+        _table_stale = false; 
+        build_sector_map(); 
+        if(_table._num_files > 0){
+            // carry on after the newest file 
+            FlashFAT_file_entry *last = &_table._files[_table._num_files - 1]; 
+            _allocation_cursor = ((last->_start_page + last->_page_length) * 256 + last->_end_offset + 4095) >> 12; 
+            _last_file_sectors = _allocation_cursor - (last->_start_page >> 4); 
+        }
+    }
+    return status; 
+}
 
+void FlashFAT::build_sector_map(){
+    memset(_sector_map, 0, sizeof(_sector_map)); 
+    _used_bytes = 0; 
+    for(uint i = 0; i < _table._num_files; i ++){
+        uint32_t start = _table._files[i]._start_page * 256; 
+        uint32_t length = _table._files[i]._page_length * 256 + _table._files[i]._end_offset; 
+        mark_sectors(start, start + length); 
+        _used_bytes += length; 
+    }
+    count_free_sectors(0, 0); 
+}
 
+void FlashFAT::mark_sectors(uint32_t start, uint32_t end){
+    // empty files don't hold a sector 
+    if(end <= start) return; 
+    for(uint32_t sector = start >> 12; sector <= (end - 1) >> 12 && sector < FLASH_FAT_MAX_SECTORS; sector ++){
+        _sector_map[sector >> 3] |= 1 << (sector & 7); 
+        // whatever a saved erased map says, a sector holding a file isn't erased 
+        set_sector_erased(sector, false); 
+    }
+}
 
+void FlashFAT::count_free_sectors(uint32_t skip_first, uint32_t skip_end){
+    _free_sectors = 0; 
+    _largest_free = 0; 
+    if(_flash == NULL) return; 
+    uint32_t run = 0; 
+    for(uint32_t sector = FLASH_FAT_DATA_START / 4096; sector < sector_count(); sector ++){
+        if(sector_used(sector)){
+            run = 0; 
+            continue; 
+        }
+        _free_sectors ++; 
+        // the open file's run is counted from its write end instead 
+        if(sector >= skip_first && sector < skip_end){
+            run = 0; 
+            continue; 
+        }
+        run ++; 
+        if(run > _largest_free) _largest_free = run; 
+    }
+}
 
+bool FlashFAT::sector_used(uint32_t sector){
+    if(sector >= FLASH_FAT_MAX_SECTORS) return true; 
+    return _sector_map[sector >> 3] & (1 << (sector & 7)); 
+}
 
+bool FlashFAT::sector_erased(uint32_t sector){
+    if(sector >= FLASH_FAT_MAX_SECTORS) return false; 
+    return _erased_map[sector >> 3] & (1 << (sector & 7)); 
+}
 
+void FlashFAT::set_sector_erased(uint32_t sector, bool erased){
+    if(sector >= FLASH_FAT_MAX_SECTORS) return; 
+    if(erased) _erased_map[sector >> 3] |= 1 << (sector & 7); 
+    else _erased_map[sector >> 3] &= ~(1 << (sector & 7)); 
+}
 
+uint32_t FlashFAT::sector_count(){
+    uint32_t sectors = _flash->capacity() / 4096; 
+    // the maps end here, begin() told the caller 
+    if(sectors > FLASH_FAT_MAX_SECTORS) sectors = FLASH_FAT_MAX_SECTORS; 
+    return sectors; 
+}
 
+bool FlashFAT::find_free_sectors(uint32_t *first, uint32_t *end, uint32_t need){
+    uint32_t sectors = sector_count(); 
+    uint32_t data_start = FLASH_FAT_DATA_START / 4096; 
+    if(data_start >= sectors) return false; 
+    uint32_t span = sectors - data_start; 
+    uint32_t cursor = _allocation_cursor; 
+    if(cursor < data_start || cursor >= sectors) cursor = data_start; 
+    // first pass finds the largest run, the second the least worn of the ones big enough 
+    uint32_t largest = 0; 
+    uint64_t best_wear = 0; 
+    uint32_t best_length = 0; 
+    for(uint pass = 0; pass < 2; pass ++){
+        uint32_t run_start = 0; 
+        uint32_t run_length = 0; 
+        uint64_t run_wear = 0; 
+        // once around the chip from the cursor 
+        for(uint32_t step = 0; step <= span; step ++){
+            uint32_t sector = data_start + (cursor - data_start + step) % span; 
+            // runs end at used sectors, at the end of the chip and back at the cursor 
+            if(step == span || sector_used(sector) || (sector == data_start && step > 0)){
+                if(pass == 0 && run_length > largest) largest = run_length; 
+                // lower mean wear, compared without dividing 
+                bool big_enough = run_length * 2 >= largest || (_last_file_sectors > 0 && run_length >= _last_file_sectors * 2); 
+                if(need > 0) big_enough = run_length >= need; 
+                if(pass == 1 && run_length > 0 && big_enough && 
+                    (best_length == 0 || run_wear * best_length < best_wear * run_length)){
+                    best_wear = run_wear; 
+                    best_length = run_length; 
+                    *first = run_start; 
+                    *end = run_start + run_length; 
+                }
+                run_length = 0; 
+                run_wear = 0; 
+                if(step == span || sector_used(sector)) continue; 
+            }
+            if(run_length == 0) run_start = sector; 
+            run_length ++; 
+            run_wear += _erase_counts[sector / FLASH_FAT_WEAR_GROUP_SECTORS]; 
+        }
+    }
+    return best_length > 0; 
+}
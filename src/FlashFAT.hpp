@@ -12,14 +12,89 @@
 #ifndef _FLASH_FAT_HPP_
 #define _FLASH_FAT_HPP_
 
-#include <Arduino.h> 
-#include "W25Q64FV.hpp"
+#include "FlashFAT_device.hpp"
+#ifdef ARDUINO
+    #include "FlashFAT_W25Q64FV.hpp"
+#endif
 
 //#define FLASH_FAT_SERIAL_DEBUG ///< Preprocessor for enabling Serial debugging output 
 
-#define FLASH_FAT_MAX_FILE_COUNT 254    ///< Maximum amount of files allowed
+#ifndef FLASH_FAT_MAX_FILE_COUNT
+    #define FLASH_FAT_MAX_FILE_COUNT 254    ///< Maximum amount of files allowed. The default is unchanged, set it up to 7281 (one journal record) at build time. Each costs 12 bytes of RAM 
+#endif
 #define FLASH_FAT_FILE_BUFFER 512       ///< Write buffer size. See README for implementation notes
-#define FLASH_FAT_NO_ERROR_FILE 255     ///< Not implemented 
+#define FLASH_FAT_NO_ERROR_FILE 0xFFFF  ///< No file left open 
+
+#ifndef FLASH_FAT_MAX_SECTORS
+    #define FLASH_FAT_MAX_SECTORS 4096      ///< 4kB sectors tracked for allocation, 4096 covers 16MB. Each costs 2 bits of RAM. Larger devices only use this many 
+#endif
+#ifndef FLASH_FAT_WEAR_GROUP_SECTORS
+    #define FLASH_FAT_WEAR_GROUP_SECTORS 16 ///< Sectors sharing an erase counter. Each counter costs 4 bytes of RAM 
+#endif
+#define FLASH_FAT_WEAR_GROUPS ((FLASH_FAT_MAX_SECTORS + FLASH_FAT_WEAR_GROUP_SECTORS - 1) / FLASH_FAT_WEAR_GROUP_SECTORS)   ///< Number of erase counters 
+#ifndef FLASH_FAT_WEAR_SAVE_ERASES
+    #define FLASH_FAT_WEAR_SAVE_ERASES 64   ///< Erases between saving the counters, at most this many are lost on power loss 
+#endif
+
+#ifndef FLASH_FAT_JOURNAL_SECTORS
+    /// Sectors in each FAT journal area, enough for the whole table, erase counters and erased map plus 2kB of records 
+    #define FLASH_FAT_JOURNAL_SECTORS ((FLASH_FAT_MAX_FILE_COUNT * 9UL + FLASH_FAT_WEAR_GROUPS * 4UL + FLASH_FAT_MAX_SECTORS / 8 + 2048 + 4095) / 4096)
+#endif
+#if FLASH_FAT_MAX_FILE_COUNT * 9UL + 4 > 65535
+    #error "Too many files for one journal record, FLASH_FAT_MAX_FILE_COUNT can be at most 7281"
+#endif
+#if FLASH_FAT_WEAR_GROUPS * 4UL + 6 > 65535
+    #error "Too many erase counters for one journal record, raise FLASH_FAT_WEAR_GROUP_SECTORS"
+#endif
+#if FLASH_FAT_MAX_FILE_COUNT * 9UL + FLASH_FAT_WEAR_GROUPS * 4UL + FLASH_FAT_MAX_SECTORS / 8 + 64 > FLASH_FAT_JOURNAL_SECTORS * 4096UL
+    #error "FLASH_FAT_JOURNAL_SECTORS too small to hold FLASH_FAT_MAX_FILE_COUNT files"
+#endif
+#ifndef FLASH_FAT_JOURNAL_AREAS
+    #define FLASH_FAT_JOURNAL_AREAS 2       ///< FAT journal areas used in turn at the front of the device 
+#endif
+#define FLASH_FAT_DATA_START (FLASH_FAT_JOURNAL_AREAS * FLASH_FAT_JOURNAL_SECTORS * 4096UL)   ///< First address available to files 
+
+#ifndef FLASH_FAT_ERASE_AHEAD
+    #define FLASH_FAT_ERASE_AHEAD 1         ///< Default sectors kept erased ahead of the write cursor 
+#endif
+
+#ifndef FLASH_FAT_TIGHT_PACKING
+    #define FLASH_FAT_TIGHT_PACKING 0       ///< Default file packing, 1 starts new files on the next free page 
+#endif
+
+#ifndef FLASH_FAT_BACKGROUND_ERASE
+    #define FLASH_FAT_BACKGROUND_ERASE 0    ///< Default for erasing deleted files from service() 
+#endif
+
+#ifndef FLASH_FAT_CHECKPOINT_BYTES
+    #define FLASH_FAT_CHECKPOINT_BYTES 0    ///< Default bytes between checkpoints of the open file, 0 for none 
+#endif
+
+#ifndef FLASH_FAT_CHECKPOINT_MS
+    #define FLASH_FAT_CHECKPOINT_MS 0       ///< Default milliseconds between checkpoints of the open file, 0 for none 
+#endif
+
+#ifndef FLASH_FAT_READ_CHUNK
+    #define FLASH_FAT_READ_CHUNK 4096       ///< Largest read done under one hold of the device lock, see FlashFAT_locked 
+#endif
+
+#ifndef FLASH_FAT_WRITE_BUFFER_COUNT
+    #define FLASH_FAT_WRITE_BUFFER_COUNT 2  ///< Number of write buffers. 1 blocks on every full buffer 
+#endif
+
+#ifndef FLASH_FAT_RING_BUFFER
+    #define FLASH_FAT_RING_BUFFER 0         ///< Bytes in the enqueue() ring buffer, a power of two up to 32768, 128 on AVR. 0 leaves it out 
+#endif
+#ifndef FLASH_FAT_RING_INDEX
+    #ifdef __AVR__
+        #define FLASH_FAT_RING_INDEX uint8_t    ///< Ring buffer counters, one byte so an interrupt never sees half of one 
+    #else
+        #define FLASH_FAT_RING_INDEX uint       ///< Ring buffer counters, loads and stores of it have to be atomic 
+    #endif
+#endif
+#if (FLASH_FAT_RING_BUFFER & (FLASH_FAT_RING_BUFFER - 1)) || FLASH_FAT_RING_BUFFER > 32768
+    #error "FLASH_FAT_RING_BUFFER must be a power of two up to 32768"
+#endif
 
 
 /**
@@ -27,8 +102,8 @@
  * 
  */
 typedef struct{
-    uint16_t _start_page;       ///< Start page (page is 256)
-    uint16_t _page_length;      ///< Length of the file in pages (256 bytes). Inclusive
+    uint32_t _start_page;       ///< Start page (page is 256)
+    uint32_t _page_length;      ///< Length of the file in pages (256 bytes). Inclusive
     uint8_t _end_offset;        ///< End offset on the last page. Not inclusive
 }   FlashFAT_file_entry; 
 
@@ -37,11 +112,44 @@ typedef struct{
  * 
  */
 typedef struct{
-    uint8_t _num_files;                                     ///< Number of files on the system. 1 indexed
-    uint8_t _file_close_err;                                ///< Not implemented yet
+    uint16_t _num_files;                                    ///< Number of files on the system. 1 indexed
+    uint16_t _file_close_err;                               ///< File left open, FLASH_FAT_NO_ERROR_FILE if none
     FlashFAT_file_entry _files[FLASH_FAT_MAX_FILE_COUNT];   ///< Allocation for files 
 }   FlashFAT_file_allocation_table; 
 
+/**
+ * @brief Erase counts of the chip 
+ * 
+ * Counts are sector erases in a group of FLASH_FAT_WEAR_GROUP_SECTORS sectors, the library keeps no finer count. 
+ * Divide by FLASH_FAT_WEAR_GROUP_SECTORS for erases per sector 
+ */
+typedef struct{
+    uint32_t min_erases;        ///< Sector erases in the least erased group 
+    uint32_t max_erases;        ///< Sector erases in the most erased group 
+    uint32_t mean_erases;       ///< Sector erases per group, rounded 
+    uint32_t total_erases;      ///< Sector erases over the chip 
+}   FlashFAT_wear_stats; 
+
+/**
+ * @brief Counters of the enqueue() ring buffer 
+ * 
+ */
+typedef struct{
+    uint32_t overruns;          ///< enqueue() calls refused for lack of room 
+    uint32_t overrun_bytes;     ///< Bytes in the refused calls 
+    uint32_t truncated_bytes;   ///< Bytes dropped because the open file ran out of space 
+    uint peak;                  ///< Most bytes waiting at once 
+    uint queued;                ///< Bytes waiting now 
+}   FlashFAT_ring_stats; 
+
+/**
+ * @brief Counter of the enqueue() ring buffer, wraps freely 
+ * 
+ * The interrupt and the main loop each read the other's counter, so it has to be one the chip loads and stores in 
+ * one go. Set FLASH_FAT_RING_INDEX to change it 
+ */
+typedef FLASH_FAT_RING_INDEX FlashFAT_ring_index_t; 
+
 /**
  * @brief Status return for FlashFAT
  * 
@@ -52,28 +160,54 @@ typedef enum{
     FLASHFAT_MAX_FILE_COUNT_REACHED,            ///< Maximum number of files reached. Cannot create more
     FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND,   ///< No FAT table found
     FLASHFAT_WRONG_MODE,                        ///< Library in wrong mode 
-    FLASHFAT_INVALID_FILE                       ///< File not available
+    FLASHFAT_INVALID_FILE,                      ///< File not available
+    FLASHFAT_OUT_OF_SPACE,                      ///< No free space left for the file 
+    FLASHFAT_INVALID_OFFSET,                    ///< Offset past the end of the file 
+    FLASHFAT_LEGACY_NO_SPACE,                   ///< Version 1 files in the journal space and no room to move them 
+    FLASHFAT_CAPACITY_CLAMPED                   ///< Mounted, but the device is larger than FLASH_FAT_MAX_SECTORS covers 
 }   FlashFAT_status_t; 
 
 
+class FlashFAT_File; 
+
 /**
  * @brief FlashFAT Object
  * 
  * FlashFAT is a file storage system meant to in part mimic the standard FAT system for non-volatile flash chips. 
- * Currently only supports the W25Q64FV chips, can expand to more easily. The FAT table is found at the start of the 
- * storage. Allows for Reading & Writing of files. Currently files cannot be moved or expanded after the fact
+ * Talks to the chip through a FlashFAT_device, begin(int) uses the W25Q64FV chip on Arduino. The FAT table is found 
+ * at the start of the storage. Allows for Reading & Writing of files. Currently files cannot be moved or expanded 
+ * after the fact
  */
 class FlashFAT{
 public: 
+    virtual ~FlashFAT(){} 
+
+    #ifdef ARDUINO
+        /**
+         * @brief Initialize the FlashFAT system 
+         * 
+         * Checks for an attached W25Q64FV flash chip, checks for a FAT table, creates one if none is found
+         * 
+         * @param _cs                   Chip-select pin for the Flash Chip
+         * @return FlashFAT_status_t    Return status
+         */
+        FlashFAT_status_t begin(int _cs); 
+    #endif
+
     /**
-     * @brief Initialize the FlashFAT system 
+     * @brief Initialize the FlashFAT system on a flash device 
      * 
-     * Checks for an attached flash chip, checks for a FAT table, creates one if none is found
+     * Checks for a FAT table on the device, creates one if none is found and fails if it can't be written. A file 
+     * left open by a power loss is closed at its last programmed page, the bytes still in the write buffers are 
+     * lost. A version 1 table is moved into the journal, files it had where the journal now goes are copied to 
+     * after the last file first. Without room for them nothing is changed and FLASHFAT_LEGACY_NO_SPACE is returned. 
+     * A device larger than FLASH_FAT_MAX_SECTORS covers is mounted with only its first FLASH_FAT_MAX_SECTORS sectors 
+     * used, and FLASHFAT_CAPACITY_CLAMPED is returned so the lost space doesn't go unnoticed 
      * 
-     * @param _cs                   Chip-select pin for the Flash Chip
+     * @param device                Initialized flash device. Must outlive this object 
      * @return FlashFAT_status_t    Return status
      */
-    FlashFAT_status_t begin(int _cs); 
+    FlashFAT_status_t begin(FlashFAT_device *device); 
 
     /**
      * @brief Opens a file for reading 
@@ -87,10 +221,24 @@ public:
      */
     FlashFAT_status_t open_file(uint fi); 
 
+    /**
+     * @brief Opens a file for reading through a handle 
+     * 
+     * Each handle has its own read position and any number can be open alongside each other, the single file of 
+     * READ_MODE and the file being written. Reads wait for the program or erase service() started. Deletes and 
+     * compaction wait until every handle is closed 
+     * 
+     * @param fi                    File index, 0-indexed 
+     * @param file                  Handle to open, closed first if it is open 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t open_file(uint fi, FlashFAT_File *file); 
+
     /**
      * @brief Close a file 
      * 
-     * Closes a file in READ or WRITE mode 
+     * Closes a file in READ or WRITE mode. A write that fails leaves the file open to try again. If only the 
+     * FAT record fails, the file is closed but the failure is returned, the next change rewrites the table 
      * 
      * @return FlashFAT_status_t    Return Status 
      */
@@ -99,24 +247,67 @@ public:
     /**
      * @brief Creates a new file to write to 
      * 
+     * The file goes in the least worn free run that is at least half as big as the largest or twice the size of 
+     * the last file, starting with the space after the last file so the whole chip is used in turn. It can grow 
+     * until it reaches the next used sector 
+     * 
+     * With a reserve, the file goes in the least worn free run that holds the whole reserve and that space is 
+     * erased up front, so writes up to the reserve never erase or run out of space. Space the file doesn't use 
+     * stays erased for the next file 
+     * 
      * @pre System must be in NO_MODE 
      * 
+     * @param reserve_bytes         Bytes to reserve and erase, 0 for none 
+     * @param background            Leave the erase to service() instead of blocking until it is done 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_OUT_OF_SPACE if no free run holds the reserve 
+     */
+    FlashFAT_status_t new_file(uint32_t reserve_bytes = 0, bool background = false); 
+
+    /**
+     * @brief Creates a new file to write to through a handle 
+     * 
+     * Same as new_file(), the handle writes and closes the file. Only one file is written at a time. Closing the 
+     * file with close_file() closes the handle too 
+     * 
+     * @pre System must be in NO_MODE 
+     * 
+     * @param file                  Handle to open, closed first if it is open 
+     * @param reserve_bytes         Bytes to reserve and erase, 0 for none 
+     * @param background            Leave the erase to service() instead of blocking until it is done 
      * @return FlashFAT_status_t    Return Status 
      */
-    FlashFAT_status_t new_file(); 
+    FlashFAT_status_t new_file(FlashFAT_File *file, uint32_t reserve_bytes = 0, bool background = false); 
 
     /**
      * @brief Get the file allocation table object
      * 
+     * Copies the table cached in RAM. The flash is only read at begin() or after 
+     * invalidate_file_allocation_table() 
+     * 
      * @param table                 Pointer to the table to fill out. 
      * @return FlashFAT_status_t    Return status 
      */
     FlashFAT_status_t get_file_allocation_table(FlashFAT_file_allocation_table *table); 
 
+    /**
+     * @brief Drop the cached file allocation table 
+     * 
+     * The next call that needs the table reads it back from the flash. Only needed if something other than 
+     * this object changed the chip 
+     * 
+     * @pre System must be in NO_MODE with no FlashFAT_File open for reading 
+     * 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_WRONG_MODE outside NO_MODE or with a handle open 
+     */
+    FlashFAT_status_t invalidate_file_allocation_table(); 
+
     /**
      * @brief write a buffer
      * 
-     * Writes a byte buffer to the current open file
+     * Writes a byte buffer to the current open file. Data is copied into the write buffers and programmed by 
+     * service(), only blocks when every buffer is still waiting on the flash. Writes larger than all the write 
+     * buffers, starting with the buffers empty, program their whole pages directly from buffer. A write that 
+     * would run into the next used sector is refused as a whole with FLASHFAT_OUT_OF_SPACE 
      * 
      * @pre System must be in WRITE_MODE 
      * 
@@ -126,6 +317,165 @@ public:
      */
     FlashFAT_status_t write(byte *buffer, uint length); 
 
+    #if FLASH_FAT_RING_BUFFER > 0
+        /**
+         * @brief Queue bytes for the open file from an interrupt 
+         * 
+         * Copies buffer into a lock-free ring buffer of FLASH_FAT_RING_BUFFER bytes that service() moves into the 
+         * write buffers, so it is safe from one interrupt or other single producer while the main loop or a task 
+         * calls service(). Never touches the flash or the lock. Bytes queued with no file open go into the next 
+         * file, close_file() takes in what was queued before it was called. Bytes from write() and enqueue() land 
+         * in the file in the order they reach the write buffers 
+         * 
+         * @param buffer    Buffer to queue 
+         * @param length    Length to queue 
+         * @return true     Queued 
+         * @return false    Not enough room, nothing was queued and the overrun is counted 
+         */
+        bool enqueue(const byte *buffer, uint length); 
+    #endif
+
+    /**
+     * @brief Advance pending flash work 
+     * 
+     * Moves bytes queued by enqueue() into the write buffers, then starts the next page program of the queued 
+     * write buffers if the flash is free. With nothing to program it erases the next sector until the erase ahead 
+     * is met, then erases the standby FAT journal area. With no file open it does the next step of compact(). 
+     * Only starts work when the flash is free, call from idle time in the logging loop. The one wait is inside a 
+     * journal record: one that crosses a page waits out the program of the first page, and a full journal is 
+     * rewritten a page program at a time. A full journal whose standby area isn't erased yet gets one standby 
+     * sector erase per call first, the record waits until it is done 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t service(); 
+
+    /**
+     * @brief Set the erase ahead 
+     * 
+     * Number of sectors past the write cursor that service() keeps erased, so writes only wait on page programs. 
+     * 0 erases each sector when the write cursor reaches it. 
+     * 
+     * @param sectors   Sectors to keep erased 
+     */
+    void set_erase_ahead(uint sectors); 
+
+    /**
+     * @brief Set the file packing 
+     * 
+     * Off, every new file starts on a fresh 4kB sector. On, a new file starts on the page after the last file 
+     * and shares its last sector, as long as the rest of that sector is still erased. Saves up to 4kB and an 
+     * erase per file for workloads with many small files 
+     * 
+     * @param tight     Start new files on the next free page 
+     */
+    void set_tight_packing(bool tight); 
+
+    /**
+     * @brief Set the background erase 
+     * 
+     * On, delete_all_files() and delete_file() leave the freed sectors for service() to erase in NO_MODE, 64kB 
+     * blocks at a time where the device supports it. Which sectors are erased is saved in the FAT journal, so 
+     * files written later skip those erases even after a power cycle. A new file started while a block erase is 
+     * running waits for it 
+     * 
+     * @param enable    Erase freed sectors from service() 
+     */
+    void set_background_erase(bool enable); 
+
+    /**
+     * @brief Set the checkpoint policy 
+     * 
+     * A checkpoint programs the bytes still in the write buffers and saves the open file's length in the FAT 
+     * journal, so power loss loses at most what was written since. service() takes one when either limit is 
+     * reached, a page program or journal record per call. The last page is programmed again as it fills, chips 
+     * that can't take more than one program per page should leave this off. Time comes from the device 
+     * 
+     * @param bytes     Bytes written between checkpoints, 0 for no limit 
+     * @param ms        Milliseconds between checkpoints, 0 for no limit 
+     */
+    void set_checkpoint(uint32_t bytes, uint32_t ms); 
+
+    /**
+     * @brief Check for background erase work left 
+     * 
+     * @return true     Freed sectors are still waiting for service() to erase them 
+     * @return false    Done 
+     */
+    bool is_erasing(); 
+
+    /**
+     * @brief Get the erase counts 
+     * 
+     * Counts every sector erase this library has done, saved in the FAT journal. Up to 
+     * FLASH_FAT_WEAR_SAVE_ERASES erases can go uncounted on power loss 
+     * 
+     * @param stats                 Filled with the counts 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t get_wear_stats(FlashFAT_wear_stats *stats); 
+
+    #if FLASH_FAT_RING_BUFFER > 0
+        /**
+         * @brief Get the enqueue() ring buffer counters 
+         * 
+         * Counters are never reset, a peak close to FLASH_FAT_RING_BUFFER or any overruns mean service() is not 
+         * called often enough for the producer's rate 
+         * 
+         * @param stats     Filled with the counters 
+         */
+        void get_ring_stats(FlashFAT_ring_stats *stats); 
+    #endif
+
+    /**
+     * @brief Get the free space 
+     * 
+     * Free data sectors in bytes, kept up to date as files are created and deleted so the call doesn't scan. 
+     * While writing, the sectors the open file has taken so far are not free 
+     * 
+     * @return uint32_t     Free bytes 
+     */
+    uint32_t free_bytes(); 
+
+    /**
+     * @brief Get the space used by files 
+     * 
+     * Sum of the file lengths, counting the open file up to what has been written to it 
+     * 
+     * @return uint32_t     Used bytes 
+     */
+    uint32_t used_bytes(); 
+
+    /**
+     * @brief Get the largest contiguous free space 
+     * 
+     * Largest run of free sectors in bytes, the most a new file can be sure to fit. Small holes left by deletes 
+     * count towards free_bytes() but not here. While writing, the open file's run counts from its write end 
+     * 
+     * @return uint32_t     Largest free run in bytes 
+     */
+    uint32_t largest_contiguous_free(); 
+
+    /**
+     * @brief Start compacting the files 
+     * 
+     * Moves files down into the holes left by deletes so the free space ends up in one run. The work is done by 
+     * service() in NO_MODE, one erase or page program per call. Only files with their sectors to themselves are 
+     * moved, and only into a hole they fit in whole. Creating or deleting a file drops the move in progress, the 
+     * pass carries on afterwards 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t compact(); 
+
+    /**
+     * @brief Check for compaction work left 
+     * 
+     * @return true     Compaction still has files to move or sectors to erase 
+     * @return false    Done 
+     */
+    bool is_compacting(); 
+
     /**
      * @brief read from the device 
      * 
@@ -135,7 +485,7 @@ public:
      * 
      * @param buffer    Buffer to read into 
      * @param length    Desired number of bytes to read 
-     * @return uint     Number of bytes read 
+     * @return uint     Number of bytes read, 0 at the end of the file or outside READ_MODE 
      */
     uint read(byte *buffer, uint length); 
 
@@ -151,27 +501,121 @@ public:
     uint peek(); 
 
     /**
-     * @brief Delete the last file
+     * @brief Move the read position 
      * 
+     * Files are contiguous on the flash, so any offset is one addition away 
+     * 
+     * @pre System must be in READ_MODE 
+     * 
+     * @param offset                Offset from the start of the file, up to its length 
      * @return FlashFAT_status_t    Return Status 
      */
+    FlashFAT_status_t seek(uint32_t offset); 
+
+    /**
+     * @brief Get the position in the open file 
+     * 
+     * The read position in READ_MODE, the length written so far in WRITE_MODE 
+     * 
+     * @return uint32_t     Offset from the start of the file, 0 with no file open 
+     */
+    uint32_t tell(); 
+
+    /**
+     * @brief Read from an offset of the current file 
+     * 
+     * Leaves the read position where it is 
+     * 
+     * @pre System must be in READ_MODE 
+     * 
+     * @param offset    Offset from the start of the file 
+     * @param buffer    Buffer to read into 
+     * @param length    Desired number of bytes to read 
+     * @return uint     Number of bytes read, short at the end of the file 
+     */
+    uint pread(uint32_t offset, byte *buffer, uint length); 
+
+    /**
+     * @brief Delete a file 
+     * 
+     * Frees the sectors of the file for new files. Files after it move down one index 
+     * 
+     * @pre System must be in NO_MODE with no FlashFAT_File open for reading 
+     * 
+     * @param fi                    File index, 0-indexed 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_WRONG_MODE outside NO_MODE or with a handle open 
+     */
+    FlashFAT_status_t delete_file(uint fi); 
+
+    /**
+     * @brief Delete the last file
+     * 
+     * @pre System must be in NO_MODE with no FlashFAT_File open for reading 
+     * 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_INVALID_FILE outside NO_MODE, FLASHFAT_WRONG_MODE with a 
+     *                              handle open 
+     */
     FlashFAT_status_t delete_last_file(); 
 
     /**
      * @brief Delete all files 
      * 
-     * @return FlashFAT_status_t    Return Status  
+     * @pre System must be in NO_MODE with no FlashFAT_File open for reading 
+     * 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_INVALID_FILE outside NO_MODE, FLASHFAT_WRONG_MODE with a 
+     *                              handle open 
      */
     FlashFAT_status_t delete_all_files(); 
 
     /**
      * @brief Create and write a new file allocation table object
      * 
-     * @return FlashFAT_status_t    Return Status 
+     * @pre No FlashFAT_File open 
+     * 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_WRONG_MODE with a handle open 
      */
     FlashFAT_status_t create_file_allocation_table(); 
 
+protected: 
+    /**
+     * @brief Take the lock around the table, the maps, the cursors and the write buffers 
+     * 
+     * Every public call holds it, through any wait on the flash. Reads through FlashFAT_File handles don't take 
+     * it, only opening and closing them does. Calls nest, so the lock has to be recursive. Does nothing here, 
+     * FlashFAT_locked takes a real lock 
+     */
+    virtual void lock(){} 
+
+    /**
+     * @brief Release the lock taken by lock() 
+     * 
+     */
+    virtual void unlock(){} 
+
+    /**
+     * @brief Pick the device begin() talks to 
+     * 
+     * FlashFAT_locked puts its device lock in front of the device here 
+     * 
+     * @param device            Device passed to begin() 
+     * @return FlashFAT_device* Device to use, the same one here 
+     */
+    virtual FlashFAT_device *wrap_device(FlashFAT_device *device){ return device; } 
+
 private: 
+    friend class FlashFAT_File; 
+
+    /**
+     * @brief Holds the lock for a scope 
+     * 
+     */
+    class scoped_lock{
+    public: 
+        scoped_lock(FlashFAT *fs) : _fs(fs){ _fs->lock(); } 
+        ~scoped_lock(){ _fs->unlock(); } 
+    private: 
+        FlashFAT *_fs;      ///< Locked file system 
+    }; 
 
     /**
      * @brief System mode 
@@ -183,24 +627,465 @@ private:
         FLASHFAT_NO_MODE        ///< No mode 
     } FLASHFAT_MODE; 
 
-    W25Q64FV _flash;                                ///< Flash Chip Interface Library 
+    #ifdef ARDUINO
+        FlashFAT_W25Q64FV _w25q64fv;                ///< Device used by begin(int)
+    #endif
+    FlashFAT_device *_flash = NULL;                 ///< Flash Chip Interface 
     FlashFAT_file_allocation_table _table;          ///< Local FAT table 
+    bool _table_stale = true;                       ///< _table has to be read from the flash before use 
+    bool _table_dirty = false;                      ///< _table has changes the journal failed to record 
     FLASHFAT_MODE _mode = FLASHFAT_NO_MODE;         ///< Current system mode 
-    byte _write_buffer[FLASH_FAT_FILE_BUFFER];      ///< Write buffer 
-    uint _write_buffer_index = 0;                   ///< Current index in the write buffer
-    uint _erase_index;                              ///< Last 'safe' index to write to 
-    uint _current_index;                            ///< Current index being used 
-    uint _end_index;                                ///< Last index of the file 
+    byte _write_buffers[FLASH_FAT_WRITE_BUFFER_COUNT][FLASH_FAT_FILE_BUFFER];  ///< Write buffers 
+    uint _write_buffer_index = 0;                   ///< Current index in the buffer being filled
+    uint _fill_buffer = 0;                          ///< Buffer being filled by write() 
+    uint _flush_buffer = 0;                         ///< Oldest full buffer waiting to be programmed 
+    uint _flush_page = 0;                           ///< Next page to program in the flush buffer 
+    uint _queued_buffers = 0;                       ///< Number of full buffers waiting to be programmed 
+    uint32_t _erase_index;                          ///< Last 'safe' index to write to 
+    uint _erase_ahead = FLASH_FAT_ERASE_AHEAD;      ///< Sectors to keep erased past the write cursor 
+    bool _tight_packing = FLASH_FAT_TIGHT_PACKING;  ///< Start new files on the next free page 
+    bool _background_erase = FLASH_FAT_BACKGROUND_ERASE;   ///< Erase freed sectors from service() 
+    uint32_t _free_erase_sector = 0;                ///< Next freed sector for service() to erase 
+    uint32_t _free_erase_end = 0;                   ///< End of the freed sectors waiting for service() 
+    bool _erased_journaled = false;                 ///< Last erased map in the journal had sectors in it 
+    uint32_t _spare_erase_start = 0;                ///< Start of the erased space past the last closed file 
+    uint32_t _spare_erase_end = 0;                  ///< Last index erased ahead past the last closed file 
+    uint32_t _current_index;                        ///< Current index being used 
+    uint32_t _allocation_end;                       ///< End of the free sectors the file being written can grow into 
+    uint32_t _reserve_end = 0;                      ///< End of the space reserved by new_file(), 0 if none 
+    uint32_t _end_index;                            ///< Last index of the file 
     uint _file_index;                               ///< Index in the FAT that is currently being used
+    uint32_t _journal_base = 0;                     ///< Start of the FAT journal 
+    uint32_t _journal_index = 0;                    ///< Where the next journal record goes 
+    uint32_t _journal_sequence = 0;                 ///< Sequence number of the current journal area 
+    uint _standby_erased = 0;                       ///< Sectors of the standby journal area known to be erased 
+    byte _sector_map[(FLASH_FAT_MAX_SECTORS + 7) / 8];  ///< Sectors holding file data, one bit each 
+    byte _erased_map[(FLASH_FAT_MAX_SECTORS + 7) / 8];  ///< Free sectors known to be erased, one bit each 
+    bool _compacting = false;                       ///< compact() pass running 
+    uint _compact_file = FLASH_FAT_NO_ERROR_FILE;   ///< File being moved, FLASH_FAT_NO_ERROR_FILE if none 
+    uint32_t _compact_from;                         ///< Next page to copy 
+    uint32_t _compact_to;                           ///< Where the next page goes 
+    uint32_t _compact_end;                          ///< End of the file being moved 
+    uint32_t _compact_erased_to;                    ///< End of the erased destination 
+    uint32_t _reclaim_sector = 0;                   ///< Next sector freed by a move to erase 
+    uint32_t _reclaim_end = 0;                      ///< End of the sectors freed by the last move 
+    uint32_t _erase_counts[FLASH_FAT_WEAR_GROUPS];  ///< Erases per group of sectors 
+    uint _unsaved_erases = 0;                       ///< Erases since the counters were last journaled 
+    uint32_t _allocation_cursor = 0;                ///< Sector after the last file written, free runs are tried from here 
+    uint32_t _last_file_sectors = 0;                ///< Sectors the last file took, runs twice that are big enough 
+    uint32_t _used_bytes = 0;                       ///< Bytes in closed files 
+    uint32_t _free_sectors = 0;                     ///< Free data sectors, counted when the sector map changes 
+    uint32_t _largest_free = 0;                     ///< Largest free run, not counting the run the open file took 
+    uint32_t _allocation_start = 0;                 ///< First sector the file being written took from its run 
+    uint32_t _journaled_extent = 0;                 ///< End of the open file's space saved as erased, pages stop here 
+    uint32_t _open_length = 0;                      ///< Programmed length of the open file from the journal 
+    uint32_t _open_extent = 0;                      ///< End of the open file's erased space from the journal 
+    uint32_t _checkpoint_bytes = FLASH_FAT_CHECKPOINT_BYTES;    ///< Bytes between checkpoints, 0 for no limit 
+    uint32_t _checkpoint_ms = FLASH_FAT_CHECKPOINT_MS;          ///< Milliseconds between checkpoints, 0 for no limit 
+    uint32_t _checkpoint_end = 0;                   ///< End of the open file at the last checkpoint 
+    uint32_t _checkpoint_time = 0;                  ///< Device time of the last checkpoint 
+    uint32_t _synced_end = 0;                       ///< End of the buffered bytes a checkpoint programmed 
+    uint _open_handles = 0;                         ///< FlashFAT_File handles open for reading 
+    FlashFAT_File *_writer = NULL;                  ///< FlashFAT_File writing the open file, NULL if none 
+    #if FLASH_FAT_RING_BUFFER > 0
+        byte _ring[FLASH_FAT_RING_BUFFER];          ///< enqueue() ring buffer 
+        FlashFAT_ring_index_t _ring_head = 0;       ///< Bytes ever queued, only enqueue() writes it 
+        FlashFAT_ring_index_t _ring_tail = 0;       ///< Bytes ever taken out, only drain_ring() writes it 
+        FlashFAT_ring_index_t _ring_peak = 0;       ///< Most bytes waiting at once 
+        uint32_t _ring_overruns = 0;                ///< enqueue() calls refused for lack of room 
+        uint32_t _ring_overrun_bytes = 0;           ///< Bytes in the refused calls 
+        uint32_t _ring_truncated = 0;               ///< Bytes dropped for lack of space in the file 
+    #endif
 
     /**
      * @brief Write a FAT table 
      * 
+     * Erases the journal and starts it over with the whole table. Only needed when the journal is full 
+     * 
      * @param table                 Table to write 
      * @return FlashFAT_status_t    Return Status 
      */
     FlashFAT_status_t write_file_allocation_table(FlashFAT_file_allocation_table *table);
 
+    /**
+     * @brief Read the FAT table from the flash 
+     * 
+     * @param table                 Pointer to the table to fill out. 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t read_file_allocation_table(FlashFAT_file_allocation_table *table); 
+
+    /**
+     * @brief Fill the cached table from the flash if it is stale 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t load_file_allocation_table(); 
+
+    /**
+     * @brief Close the file left open by a power loss 
+     * 
+     * Full pages went straight to the flash, so the file runs up to the first erased page. That page is binary 
+     * searched for between the last journaled progress and the end of the space it saved as erased, then the entry 
+     * is journaled closed. A page of 0xFF data ends the file early 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t recover_open_file(); 
+
+    /**
+     * @brief Write the cached table to a fresh journal area 
+     * 
+     * Clears the dirty flag once the table is on the flash 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t rewrite_table(); 
+
+    /**
+     * @brief Read a version 1 (single page) FAT table and move it into a journal 
+     * 
+     * @param table                 Pointer to the table to fill out. 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t get_legacy_file_allocation_table(FlashFAT_file_allocation_table *table); 
+
+    /**
+     * @brief Copy the version 1 files below FLASH_FAT_DATA_START to after the last file 
+     * 
+     * Sources are left alone and the copies are checked before copying again, so a power loss at any point 
+     * before or while the journal is written only repeats the migration 
+     * 
+     * @param table                 Version 1 table, entries are pointed at the copies 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_LEGACY_NO_SPACE leaves the chip as it was 
+     */
+    FlashFAT_status_t move_legacy_files(FlashFAT_file_allocation_table *table); 
+
+    /**
+     * @brief Check the header of a journal area 
+     * 
+     * @param base          Start of the area 
+     * @param sequence      Filled with the sequence number of the area 
+     * @param version       Filled with the format version of the area 
+     * @return true         Valid header 
+     * @return false        No journal in this area 
+     */
+    bool read_journal_header(uint32_t base, uint32_t *sequence, uint8_t *version); 
+
+    /**
+     * @brief Replay the records of a journal area 
+     * 
+     * @param base                  Start of the area 
+     * @param table                 Pointer to the table to fill out. 
+     * @param entry_bytes           Size of a file entry in this format version 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t replay_journal(uint32_t base, FlashFAT_file_allocation_table *table, uint entry_bytes); 
+
+    /**
+     * @brief Start of the journal area the next table rewrite goes to 
+     * 
+     * @return uint32_t     Address of the area 
+     */
+    uint32_t journal_standby_base(); 
+
+    /**
+     * @brief Erase the next sector of the standby journal area if the flash is free 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t erase_journal_standby(); 
+
+    /**
+     * @brief Check a record fits in the journal as it is 
+     * 
+     * @param length    Payload length 
+     * @return true     Fits, appending it is a page program or two 
+     * @return false    Full or missed a change, appending it rewrites the table 
+     */
+    bool journal_fits(uint16_t length); 
+
+    /**
+     * @brief Check journal_progress() can go without erasing the standby area inline 
+     * 
+     * @return true     Record fits, or the standby area is erased for the rewrite 
+     * @return false    Erase the standby area first 
+     */
+    bool progress_ready(); 
+
+    /**
+     * @brief Append a record for one file entry 
+     * 
+     * @param fi                    File index that changed 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_file(uint fi); 
+
+    /**
+     * @brief Append a record for a removed file entry 
+     * 
+     * @param fi                    File index that was removed 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_delete(uint fi); 
+
+    /**
+     * @brief Append a record with the erase counters and allocation cursor 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_wear(); 
+
+    /**
+     * @brief Append a record with the erased map 
+     * 
+     * The destination of the move in progress is saved as not erased, it is written before its file record 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_erased(); 
+
+    /**
+     * @brief Append a record with how far the open file got 
+     * 
+     * Saves the programmed length and the end of the space past it known to be erased. Pages are never 
+     * programmed past the saved end, so recovery only searches space the file wrote in order 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_progress(); 
+
+    /**
+     * @brief Check if the checkpoint policy wants a checkpoint 
+     * 
+     * @return true     A limit was reached with bytes written since the last one 
+     * @return false    Not yet 
+     */
+    bool checkpoint_due(); 
+
+    /**
+     * @brief Do the next flash operation of a checkpoint 
+     * 
+     * Programs the buffered pages one at a time, then journals the length 
+     * 
+     * @pre Write buffers all programmed, nothing queued 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t checkpoint_step(); 
+
+    #if FLASH_FAT_RING_BUFFER > 0
+        /**
+         * @brief Move queued bytes into the write buffers 
+         * 
+         * Fills the write buffers as far as they go, a write() while all of them are queued waits on the flash. 
+         * Bytes past the file's space are dropped and counted 
+         * 
+         */
+        void drain_ring(); 
+    #endif
+
+    /**
+     * @brief Byte of the erased map as it is saved 
+     * 
+     * @param i         Byte index 
+     * @return byte     Map byte without the destination of the move in progress 
+     */
+    byte erased_byte(uint i); 
+
+    /**
+     * @brief Find the part of the erased map worth saving 
+     * 
+     * @param first     Filled with the first byte with an erased sector 
+     * @param end       Filled with the byte after the last one, 0 if nothing is erased 
+     */
+    void erased_bytes(uint *first, uint *end); 
+
+    /**
+     * @brief Append a record for a changed file count 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t journal_count(); 
+
+    /**
+     * @brief Rebuild the sector map from the table 
+     * 
+     */
+    void build_sector_map(); 
+
+    /**
+     * @brief Mark the sectors of an address range as used 
+     * 
+     * Also clears them in the erased map 
+     * 
+     * @param start     Start of the range 
+     * @param end       End of the range, not inclusive 
+     */
+    void mark_sectors(uint32_t start, uint32_t end); 
+
+    /**
+     * @brief Count the free sectors and the largest free run 
+     * 
+     * @param skip_first    First sector of a run to leave out of the largest, the open file's 
+     * @param skip_end      End of that run, not inclusive, equal to skip_first for none 
+     */
+    void count_free_sectors(uint32_t skip_first, uint32_t skip_end); 
+
+    /**
+     * @brief Get the end of what has been written to the open file, buffered bytes included 
+     * 
+     * @return uint32_t     End address 
+     */
+    uint32_t write_end(); 
+
+    /**
+     * @brief Read part of a file 
+     * 
+     * @param start     Start address of the file 
+     * @param end       End address of the file 
+     * @param offset    Offset from the start of the file 
+     * @param buffer    Buffer to read into 
+     * @param length    Desired number of bytes to read 
+     * @return uint     Number of bytes read, short at the end of the file 
+     */
+    uint read_at(uint32_t start, uint32_t end, uint32_t offset, byte *buffer, uint length); 
+
+    /**
+     * @brief Pick the run of free sectors for a new file 
+     * 
+     * Free runs are split at the allocation cursor. Of the runs at least half as big as the largest or twice as 
+     * big as the last file, the one with the lowest mean erase count wins, ties go to the first one from the 
+     * cursor. With a known size every run that holds it qualifies 
+     * 
+     * @param first         Filled with the first sector of the run 
+     * @param end           Filled with the sector after the run 
+     * @param need          Sectors the run has to hold, 0 if unknown 
+     * @return true         Run found 
+     * @return false        No free run big enough 
+     */
+    bool find_free_sectors(uint32_t *first, uint32_t *end, uint32_t need); 
+
+    /**
+     * @brief Check the sector map 
+     * 
+     * @param sector    Sector number 
+     * @return true     Sector holds file data, or is past FLASH_FAT_MAX_SECTORS 
+     * @return false    Sector is free 
+     */
+    bool sector_used(uint32_t sector); 
+
+    /**
+     * @brief Check a free sector is known to be erased 
+     * 
+     * @param sector    Sector number 
+     * @return true     Erased since it was freed 
+     * @return false    Unknown 
+     */
+    bool sector_erased(uint32_t sector); 
+
+    /**
+     * @brief Remember if a free sector is erased 
+     * 
+     * @param sector    Sector number 
+     * @param erased    Sector is erased 
+     */
+    void set_sector_erased(uint32_t sector, bool erased); 
+
+    /**
+     * @brief Number of sectors the allocator works with 
+     * 
+     * The device capacity is clamped to FLASH_FAT_MAX_SECTORS, the maps have no bits past it. begin() reports the 
+     * clamp with FLASHFAT_CAPACITY_CLAMPED 
+     * 
+     * @return uint32_t     Sectors on the device, up to FLASH_FAT_MAX_SECTORS 
+     */
+    uint32_t sector_count(); 
+
+    /**
+     * @brief Erase a sector and count it 
+     * 
+     * @param address                   Address in the sector 
+     * @return FlashFAT_device_status_t Return status 
+     */
+    FlashFAT_device_status_t erase_sector(uint32_t address); 
+
+    /**
+     * @brief Erase a 32kB or 64kB block and count it 
+     * 
+     * @param address                   Block aligned address 
+     * @param size                      FLASH_FAT_BLOCK_SIZE or FLASH_FAT_HALF_BLOCK_SIZE 
+     * @return FlashFAT_device_status_t Return status, FLASHFAT_DEVICE_UNSUPPORTED if the device can't 
+     */
+    FlashFAT_device_status_t erase_block(uint32_t address, uint32_t size); 
+
+    /**
+     * @brief Do the next erase of the freed sectors if the flash is free 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t free_erase_step(); 
+
+    /**
+     * @brief Get the sector after the erase index ready for the file 
+     * 
+     * Erases it unless it is known to be erased already. A file that has already written a block worth takes 
+     * the whole 64kB or 32kB block in one erase when it starts there, fits before the next used sector and has 
+     * no erased sectors in it. The flash must be free 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t erase_next_sector(); 
+
+    /**
+     * @brief Do the next flash operation of compaction if the flash is free 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t compact_step(); 
+
+    /**
+     * @brief Pick the next file to move 
+     * 
+     * @return true     Move set up 
+     * @return false    Nothing left to move 
+     */
+    bool plan_move(); 
+
+    /**
+     * @brief Check no other file touches the sectors of a file 
+     * 
+     * @param fi        File index 
+     * @return true     Sectors belong to this file alone 
+     * @return false    Shares a sector with another file 
+     */
+    bool owns_sectors(uint fi); 
+
+    /**
+     * @brief Drop the move and sector erases in progress 
+     * 
+     */
+    void abandon_move(); 
+
+    /**
+     * @brief Check a range of the flash reads back erased 
+     * 
+     * @param address       Start of the range 
+     * @param length        Length of the range 
+     * @return true         Every byte is 0xFF 
+     * @return false        Something is programmed, or the read failed 
+     */
+    bool is_erased(uint32_t address, uint32_t length); 
+
+    /**
+     * @brief Program every queued write buffer 
+     * 
+     * Blocks until the flash is done with all full buffers. The partially filled buffer is left alone 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t flush_write_buffers(); 
+
     #ifdef FLASH_FAT_SERIAL_DEBUG
         /**
          * @brief Print a buffer to serial 
@@ -230,6 +1115,98 @@ private:
 
 }; 
 
+/**
+ * @brief Handle to an open file 
+ * 
+ * Opened by FlashFAT::open_file(uint, FlashFAT_File *) for reading or FlashFAT::new_file(FlashFAT_File *) for 
+ * writing. Read handles keep their own position and can be open alongside each other and the file being written. 
+ * A read handle closes itself when destroyed, close a write handle with close() to save the file. A write handle 
+ * is also closed when its file is closed through FlashFAT::close_file() 
+ */
+class FlashFAT_File{
+public: 
+    FlashFAT_File(){} 
+    ~FlashFAT_File(); 
+
+    /**
+     * @brief Read from the read position 
+     * 
+     * @param buffer    Buffer to read into 
+     * @param length    Desired number of bytes to read 
+     * @return uint     Number of bytes read, 0 at the end of the file or for a write handle 
+     */
+    uint read(byte *buffer, uint length); 
+
+    /**
+     * @brief Read from an offset, leaving the read position where it is 
+     * 
+     * @param offset    Offset from the start of the file 
+     * @param buffer    Buffer to read into 
+     * @param length    Desired number of bytes to read 
+     * @return uint     Number of bytes read, short at the end of the file 
+     */
+    uint pread(uint32_t offset, byte *buffer, uint length); 
+
+    /**
+     * @brief Move the read position 
+     * 
+     * @param offset                Offset from the start of the file, up to its length 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t seek(uint32_t offset); 
+
+    /**
+     * @brief Get the read position, or the length written so far for a write handle 
+     * 
+     * @return uint32_t     Offset from the start of the file 
+     */
+    uint32_t tell(); 
+
+    /**
+     * @brief Check the remaining length past the read position 
+     * 
+     * @return uint     Length remaining 
+     */
+    uint peek(); 
+
+    /**
+     * @brief Write to the file 
+     * 
+     * @param buffer                Buffer to write 
+     * @param length                Length to write 
+     * @return FlashFAT_status_t    Return Status, FLASHFAT_WRONG_MODE for a read handle 
+     */
+    FlashFAT_status_t write(byte *buffer, uint length); 
+
+    /**
+     * @brief Close the handle, saving the file for a write handle 
+     * 
+     * @return FlashFAT_status_t    Return Status 
+     */
+    FlashFAT_status_t close(); 
+
+    /**
+     * @brief Check the handle is open 
+     * 
+     * @return true     Open 
+     * @return false    Closed 
+     */
+    bool is_open(){ return _fs != NULL; } 
+
+private: 
+    friend class FlashFAT; 
+
+    FlashFAT *_fs = NULL;                           ///< File system the handle is open on, NULL if closed 
+    bool _writing = false;                          ///< Write handle 
+    uint32_t _start = 0;                            ///< Start address of the file 
+    uint32_t _end = 0;                              ///< End address of the file when opened 
+    uint32_t _position = 0;                         ///< Read position from the start of the file 
+
+    // the open count in FlashFAT can't follow copies 
+    FlashFAT_File(const FlashFAT_File &) = delete; 
+    FlashFAT_File &operator=(const FlashFAT_File &) = delete; 
+}; 
+
 
 
 #endif 
\ No newline at end of file
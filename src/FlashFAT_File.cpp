@@ -0,0 +1,60 @@
+#include "FlashFAT.hpp"
+
+FlashFAT_File::~FlashFAT_File(){
+    // closing a write handle programs and journals, leave that to the caller
+    if(!_writing){
+        close();
+        return;
+    }
+    if(_fs == NULL) return;
+    // the file stays open, only the handle goes
+    FlashFAT::scoped_lock guard(_fs);
+    if(_fs->_writer == this) _fs->_writer = NULL;
+}
+
+uint FlashFAT_File::read(byte *buffer, uint length){
+    uint read_length = pread(_position, buffer, length);
+    _position += read_length;
+    return read_length;
+}
+
+uint FlashFAT_File::pread(uint32_t offset, byte *buffer, uint length){
+    if(_fs == NULL || _writing) return 0;
+    return _fs->read_at(_start, _end, offset, buffer, length);
+}
+
+FlashFAT_status_t FlashFAT_File::seek(uint32_t offset){
+    if(_fs == NULL || _writing) return FLASHFAT_WRONG_MODE;
+    if(offset > _end - _start) return FLASHFAT_INVALID_OFFSET;
+    _position = offset;
+    return FLASHFAT_OK;
+}
+
+uint32_t FlashFAT_File::tell(){
+    if(_fs == NULL) return 0;
+    if(_writing) return _fs->tell();
+    return _position;
+}
+
+uint FlashFAT_File::peek(){
+    if(_fs == NULL || _writing) return 0;
+    return _end - _start - _position;
+}
+
+FlashFAT_status_t FlashFAT_File::write(byte *buffer, uint length){
+    if(_fs == NULL || !_writing) return FLASHFAT_WRONG_MODE;
+    return _fs->write(buffer, length);
+}
+
+FlashFAT_status_t FlashFAT_File::close(){
+    if(_fs == NULL) return FLASHFAT_OK;
+    if(_writing){
+        // close_file() closes the handle with the file, a failed FAT record closes it anyway
+        // and a failed write leaves both open to try again
+        return _fs->close_file();
+    }
+    FlashFAT::scoped_lock guard(_fs);
+    _fs->_open_handles --;
+    _fs = NULL;
+    return FLASHFAT_OK;
+}
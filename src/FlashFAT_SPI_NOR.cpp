@@ -0,0 +1,151 @@
+#include "FlashFAT_SPI_NOR.hpp"
+
+#ifdef ARDUINO
+
+#define FLASH_FAT_SPI_NOR_WRITE_ENABLE 0x06
+#define FLASH_FAT_SPI_NOR_READ_STATUS 0x05
+#define FLASH_FAT_SPI_NOR_JEDEC_ID 0x9F
+#define FLASH_FAT_SPI_NOR_RELEASE_POWER_DOWN 0xAB
+#define FLASH_FAT_SPI_NOR_READ 0x03
+#define FLASH_FAT_SPI_NOR_READ_4B 0x13
+#define FLASH_FAT_SPI_NOR_PAGE_PROGRAM 0x02
+#define FLASH_FAT_SPI_NOR_PAGE_PROGRAM_4B 0x12
+#define FLASH_FAT_SPI_NOR_SECTOR_ERASE 0x20
+#define FLASH_FAT_SPI_NOR_SECTOR_ERASE_4B 0x21
+#define FLASH_FAT_SPI_NOR_HALF_BLOCK_ERASE 0x52
+#define FLASH_FAT_SPI_NOR_BLOCK_ERASE 0xD8
+#define FLASH_FAT_SPI_NOR_BLOCK_ERASE_4B 0xDC
+
+#define FLASH_FAT_SPI_NOR_BUSY 0x01     ///< BUSY bit of status register 1
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::begin(int cs, uint32_t capacity, uint32_t clock, SPIClass &spi){
+    _cs = cs;
+    _spi = &spi;
+    _settings = SPISettings(clock, MSBFIRST, SPI_MODE0);
+    pinMode(_cs, OUTPUT);
+    digitalWrite(_cs, HIGH);
+    _spi->begin();
+    command(FLASH_FAT_SPI_NOR_RELEASE_POWER_DOWN);
+    delayMicroseconds(50);
+    // manufacturer, memory type, capacity
+    select();
+    _spi->transfer(FLASH_FAT_SPI_NOR_JEDEC_ID);
+    byte manufacturer = _spi->transfer(0);
+    _spi->transfer(0);
+    byte size = _spi->transfer(0);
+    deselect();
+    if(manufacturer == 0x00 || manufacturer == 0xFF) return FLASHFAT_DEVICE_FAILURE;
+    if(capacity == 0){
+        // 2^n bytes up to 256Mb, Winbond continues with 0x20 = 512Mb, 0x21 = 1Gb
+        if(size >= 0x10 && size <= 0x19) capacity = 1UL << size;
+        else if(size >= 0x20 && size <= 0x22) capacity = 1UL << (size - 0x20 + 26);
+        else return FLASHFAT_DEVICE_FAILURE;
+    }
+    _capacity = capacity;
+    _four_byte = _capacity > 16777216UL;
+    return wait_until_free();
+}
+
+void FlashFAT_SPI_NOR::select(){
+    _spi->beginTransaction(_settings);
+    digitalWrite(_cs, LOW);
+}
+
+void FlashFAT_SPI_NOR::deselect(){
+    digitalWrite(_cs, HIGH);
+    _spi->endTransaction();
+}
+
+void FlashFAT_SPI_NOR::command(byte command){
+    select();
+    _spi->transfer(command);
+    deselect();
+}
+
+void FlashFAT_SPI_NOR::command(byte command, uint32_t address){
+    if(_four_byte){
+        // same command with a 4 byte address
+        if(command == FLASH_FAT_SPI_NOR_READ) command = FLASH_FAT_SPI_NOR_READ_4B;
+        else if(command == FLASH_FAT_SPI_NOR_PAGE_PROGRAM) command = FLASH_FAT_SPI_NOR_PAGE_PROGRAM_4B;
+        else if(command == FLASH_FAT_SPI_NOR_SECTOR_ERASE) command = FLASH_FAT_SPI_NOR_SECTOR_ERASE_4B;
+        else if(command == FLASH_FAT_SPI_NOR_BLOCK_ERASE) command = FLASH_FAT_SPI_NOR_BLOCK_ERASE_4B;
+    }
+    select();
+    _spi->transfer(command);
+    if(_four_byte) _spi->transfer(address >> 24);
+    _spi->transfer(address >> 16);
+    _spi->transfer(address >> 8);
+    _spi->transfer(address);
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::read_page(uint32_t address, byte *buffer){
+    return read(address, buffer, FLASH_FAT_PAGE_SIZE);
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::read(uint32_t address, byte *buffer, uint32_t length){
+    if(address >= _capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(is_busy()) return FLASHFAT_DEVICE_BUSY;
+    // the address auto increments for as long as the chip stays selected
+    command(FLASH_FAT_SPI_NOR_READ, address);
+    for(uint32_t i = 0; i < length; i ++) buffer[i] = _spi->transfer(0);
+    deselect();
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::write_page(uint32_t address, byte *buffer){
+    if(address >= _capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(is_busy()) return FLASHFAT_DEVICE_BUSY;
+    command(FLASH_FAT_SPI_NOR_WRITE_ENABLE);
+    command(FLASH_FAT_SPI_NOR_PAGE_PROGRAM, address);
+    for(uint i = 0; i < FLASH_FAT_PAGE_SIZE; i ++) _spi->transfer(buffer[i]);
+    deselect();
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::erase_sector(uint32_t address){
+    if(address >= _capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(is_busy()) return FLASHFAT_DEVICE_BUSY;
+    command(FLASH_FAT_SPI_NOR_WRITE_ENABLE);
+    command(FLASH_FAT_SPI_NOR_SECTOR_ERASE, address);
+    deselect();
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::erase_block(uint32_t address){
+    if(address >= _capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(is_busy()) return FLASHFAT_DEVICE_BUSY;
+    command(FLASH_FAT_SPI_NOR_WRITE_ENABLE);
+    command(FLASH_FAT_SPI_NOR_BLOCK_ERASE, address);
+    deselect();
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::erase_half_block(uint32_t address){
+    // W25Q256 and up only have 4 byte sector and 64kB erases, FlashFAT falls back to sectors
+    if(_four_byte) return FLASHFAT_DEVICE_UNSUPPORTED;
+    if(address >= _capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(is_busy()) return FLASHFAT_DEVICE_BUSY;
+    command(FLASH_FAT_SPI_NOR_WRITE_ENABLE);
+    command(FLASH_FAT_SPI_NOR_HALF_BLOCK_ERASE, address);
+    deselect();
+    return FLASHFAT_DEVICE_OK;
+}
+
+bool FlashFAT_SPI_NOR::is_busy(){
+    select();
+    _spi->transfer(FLASH_FAT_SPI_NOR_READ_STATUS);
+    byte status = _spi->transfer(0);
+    deselect();
+    return status & FLASH_FAT_SPI_NOR_BUSY;
+}
+
+FlashFAT_device_status_t FlashFAT_SPI_NOR::wait_until_free(){
+    // chip erase is the longest operation, 100s max
+    uint32_t start = millis();
+    while(is_busy()){
+        if(millis() - start > 100000UL) return FLASHFAT_DEVICE_FAILURE;
+    }
+    return FLASHFAT_DEVICE_OK;
+}
+
+#endif
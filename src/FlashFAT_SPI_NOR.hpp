@@ -0,0 +1,83 @@
+/**
+ * @file FlashFAT_SPI_NOR.hpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief Generic SPI NOR flash device for the FLASH FAT Library
+ * @version 0.1
+ * @date June 2022
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_FAT_SPI_NOR_HPP_
+#define _FLASH_FAT_SPI_NOR_HPP_
+
+#ifdef ARDUINO
+
+#include <SPI.h>
+#include "FlashFAT_device.hpp"
+
+#define FLASH_FAT_SPI_NOR_CLOCK 20000000UL      ///< Default SPI clock
+
+/**
+ * @brief FlashFAT_device for W25Q-style SPI NOR chips
+ *
+ * Reads the size from the JEDEC ID. Parts over 16MB (W25Q256 and up) use the 4 byte address commands, so the chip
+ * never has to be switched into 4 byte address mode. Those parts have no 4 byte 32kB erase, erase_half_block() reports
+ * FLASHFAT_DEVICE_UNSUPPORTED on them. Reads stream with one command and is_busy() reads the status register, so
+ * service() never blocks.
+ */
+class FlashFAT_SPI_NOR : public FlashFAT_device{
+public:
+    /**
+     * @brief Initialize the chip
+     *
+     * @param cs                        Chip-select pin for the Flash Chip
+     * @param capacity                  Size in bytes, 0 reads it from the JEDEC ID
+     * @param clock                     SPI clock
+     * @param spi                       SPI bus the chip is on
+     * @return FlashFAT_device_status_t Return status
+     */
+    FlashFAT_device_status_t begin(int cs, uint32_t capacity = 0, uint32_t clock = FLASH_FAT_SPI_NOR_CLOCK, SPIClass &spi = SPI);
+
+    uint32_t capacity(){ return _capacity; }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t read(uint32_t address, byte *buffer, uint32_t length);
+    FlashFAT_device_status_t write_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t erase_sector(uint32_t address);
+    FlashFAT_device_status_t erase_block(uint32_t address);
+    FlashFAT_device_status_t erase_half_block(uint32_t address);
+    bool is_busy();
+    FlashFAT_device_status_t wait_until_free();
+
+private:
+    SPIClass *_spi = NULL;          ///< SPI bus
+    SPISettings _settings;          ///< Bus settings for the chip
+    int _cs = -1;                   ///< Chip-select pin
+    uint32_t _capacity = 0;         ///< Size of the chip
+    bool _four_byte = false;        ///< Use 4 byte address commands
+
+    /**
+     * @brief Select the chip and send a command with an address
+     *
+     * Leaves the chip selected, call deselect() when done
+     *
+     * @param command   Command byte, 3 byte address version
+     * @param address   Address to send
+     */
+    void command(byte command, uint32_t address);
+
+    /**
+     * @brief Send a single byte command
+     *
+     * @param command   Command byte
+     */
+    void command(byte command);
+
+    void select();
+    void deselect();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#include "FlashFAT_W25Q64FV.hpp"
+
+#ifdef ARDUINO
+
+FlashFAT_device_status_t FlashFAT_W25Q64FV::begin(int _cs){
+    if(_flash.begin(_cs) != W25Q64FV_OK) return FLASHFAT_DEVICE_FAILURE;
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_W25Q64FV::read_page(uint32_t address, byte *buffer){
+    if(address >= FLASH_FAT_W25Q64FV_CAPACITY) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(_flash.read_page(address, buffer) != W25Q64FV_OK) return FLASHFAT_DEVICE_FAILURE;
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_W25Q64FV::write_page(uint32_t address, byte *buffer){
+    if(address >= FLASH_FAT_W25Q64FV_CAPACITY) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    _flash.enable_writing();
+    if(_flash.write_page(address, buffer) != W25Q64FV_OK) return FLASHFAT_DEVICE_FAILURE;
+    _op_start = micros();
+    _op_time = FLASH_FAT_W25Q64FV_PAGE_PROGRAM_US;
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_W25Q64FV::erase_sector(uint32_t address){
+    if(address >= FLASH_FAT_W25Q64FV_CAPACITY) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    _flash.enable_writing();
+    if(_flash.erase_sector(address) != W25Q64FV_OK) return FLASHFAT_DEVICE_FAILURE;
+    _op_start = micros();
+    _op_time = FLASH_FAT_W25Q64FV_SECTOR_ERASE_US;
+    return FLASHFAT_DEVICE_OK;
+}
+
+bool FlashFAT_W25Q64FV::is_busy(){
+    if(_op_time == 0) return false;
+    // still inside the typical operation time
+    if((uint32_t)(micros() - _op_start) < _op_time) return true;
+    // should be done, confirm with the chip
+    wait_until_free();
+    return false;
+}
+
+FlashFAT_device_status_t FlashFAT_W25Q64FV::wait_until_free(){
+    _op_time = 0;
+    if(_flash.wait_until_free() != W25Q64FV_OK) return FLASHFAT_DEVICE_FAILURE;
+    return FLASHFAT_DEVICE_OK;
+}
+
+#endif
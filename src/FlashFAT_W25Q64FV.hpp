@@ -0,0 +1,55 @@
+/**
+ * @file FlashFAT_W25Q64FV.hpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief W25Q64FV flash device for the FLASH FAT Library
+ * @version 0.1
+ * @date June 2022
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_FAT_W25Q64FV_HPP_
+#define _FLASH_FAT_W25Q64FV_HPP_
+
+#ifdef ARDUINO
+
+#include "FlashFAT_device.hpp"
+#include "W25Q64FV.hpp"
+
+#define FLASH_FAT_W25Q64FV_CAPACITY 8388608UL       ///< 64 Mbit
+#define FLASH_FAT_W25Q64FV_PAGE_PROGRAM_US 700      ///< Typical page program time (tPP)
+#define FLASH_FAT_W25Q64FV_SECTOR_ERASE_US 45000    ///< Typical sector erase time (tSE)
+
+/**
+ * @brief FlashFAT_device wrapper around the W25Q64FV driver
+ *
+ * The driver only exposes a blocking wait_until_free(), so is_busy() reports busy until the typical
+ * datasheet time of the last operation has passed and then confirms with the driver.
+ */
+class FlashFAT_W25Q64FV : public FlashFAT_device{
+public:
+    /**
+     * @brief Initialize the chip
+     *
+     * @param _cs                       Chip-select pin for the Flash Chip
+     * @return FlashFAT_device_status_t Return status
+     */
+    FlashFAT_device_status_t begin(int _cs);
+
+    uint32_t capacity(){ return FLASH_FAT_W25Q64FV_CAPACITY; }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t write_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t erase_sector(uint32_t address);
+    bool is_busy();
+    FlashFAT_device_status_t wait_until_free();
+
+private:
+    W25Q64FV _flash;                ///< Flash Chip Interface Library
+    uint32_t _op_start = 0;         ///< micros() at the start of the last program or erase
+    uint32_t _op_time = 0;          ///< Expected duration of the last program or erase, 0 if none pending
+};
+
+#endif
+
+#endif
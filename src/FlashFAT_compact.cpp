@@ -0,0 +1,142 @@
+#include "FlashFAT.hpp"
+
+/*
+    Compaction slides files down into the holes deletes leave behind, so the free space collects into one run at
+    the end of the chip. Each move copies a whole file into a hole it fits in completely: the old copy stays valid
+    until the FILE record pointing at the new one is journaled, so losing power mid-move only loses the move.
+
+    service() does one flash operation per call: erase a destination sector, copy one page, journal the moved
+    entry or erase one of the sectors the move freed. Erased sectors are remembered so new files skip the erase.
+*/
+
+FlashFAT_status_t FlashFAT::compact(){
+    scoped_lock guard(this);
+    if(_flash == NULL) return FLASHFAT_FLASH_FAILURE;
+    FlashFAT_status_t status = load_file_allocation_table();
+    if(status != FLASHFAT_OK) return status;
+    _compacting = true;
+    return FLASHFAT_OK;
+}
+
+bool FlashFAT::is_compacting(){
+    scoped_lock guard(this);
+    return _compacting || _compact_file != FLASH_FAT_NO_ERROR_FILE || _reclaim_sector < _reclaim_end;
+}
+
+void FlashFAT::abandon_move(){
+    // the copy so far is in free sectors, the table still points at the old one
+    _compact_file = FLASH_FAT_NO_ERROR_FILE;
+    _reclaim_sector = _reclaim_end;
+}
+
+bool FlashFAT::owns_sectors(uint fi){
+    uint32_t start = _table._files[fi]._start_page * 256;
+    uint32_t end = start + _table._files[fi]._page_length * 256 + _table._files[fi]._end_offset;
+    for(uint i = 0; i < _table._num_files; i ++){
+        if(i == fi) continue;
+        uint32_t other_start = _table._files[i]._start_page * 256;
+        uint32_t other_end = other_start + _table._files[i]._page_length * 256 + _table._files[i]._end_offset;
+        if(other_end <= other_start) continue;
+        // tight packing shares sectors between neighbours
+        if((other_start >> 12) <= ((end - 1) >> 12) && ((other_end - 1) >> 12) >= (start >> 12)) return false;
+    }
+    return true;
+}
+
+bool FlashFAT::plan_move(){
+    uint32_t sectors = sector_count();
+    uint32_t hole = FLASH_FAT_DATA_START / 4096;
+    while(hole < sectors){
+        // lowest hole with files after it
+        while(hole < sectors && sector_used(hole)) hole ++;
+        uint32_t hole_end = hole;
+        while(hole_end < sectors && !sector_used(hole_end)) hole_end ++;
+        if(hole_end >= sectors) return false;
+        // the highest file that fits grows the free run at the end the most
+        int best = -1;
+        for(uint i = 0; i < _table._num_files; i ++){
+            uint32_t start = _table._files[i]._start_page * 256;
+            uint32_t end = start + _table._files[i]._page_length * 256 + _table._files[i]._end_offset;
+            if(end <= start || (start & 4095) != 0 || start < hole_end * 4096 || i == _table._file_close_err) continue;
+            if(((end - 1) >> 12) - (start >> 12) + 1 > hole_end - hole) continue;
+            if(best >= 0 && start < _table._files[best]._start_page * 256) continue;
+            if(!owns_sectors(i)) continue;
+            best = i;
+        }
+        if(best >= 0){
+            FlashFAT_file_entry *file = &_table._files[best];
+            _compact_file = best;
+            _compact_from = file->_start_page * 256;
+            _compact_end = _compact_from + file->_page_length * 256 + file->_end_offset;
+            _compact_to = hole * 4096;
+            _compact_erased_to = _compact_to;
+            // the hole may be what the last file erased ahead
+            _spare_erase_end = 0;
+            // a saved erased map can't claim the destination once it is written to
+            bool erased = false;
+            for(uint32_t s = hole; s <= (_compact_to + (_compact_end - _compact_from) - 1) >> 12; s ++) erased |= sector_erased(s);
+            if(erased && _erased_journaled && journal_erased() != FLASHFAT_OK){
+                _compact_file = FLASH_FAT_NO_ERROR_FILE;
+                return false;
+            }
+            return true;
+        }
+        hole = hole_end;
+    }
+    return false;
+}
+
+FlashFAT_status_t FlashFAT::compact_step(){
+    if(!is_compacting()) return FLASHFAT_OK;
+    // open handles read files where they are
+    if(_open_handles > 0) return FLASHFAT_OK;
+    if(_flash->is_busy()) return FLASHFAT_OK;
+    // erase what the last move freed up
+    while(_reclaim_sector < _reclaim_end){
+        uint32_t sector = _reclaim_sector;
+        _reclaim_sector ++;
+        if(sector_used(sector) || sector_erased(sector)) continue;
+        if(erase_sector(sector * 4096) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+        set_sector_erased(sector, true);
+        return FLASHFAT_OK;
+    }
+    if(_compact_file == FLASH_FAT_NO_ERROR_FILE){
+        if(!_compacting) return FLASHFAT_OK;
+        if(!plan_move()){
+            // nothing left to move
+            _compacting = false;
+            return FLASHFAT_OK;
+        }
+        // saving the erased map for the move leaves the flash busy
+        if(_flash->is_busy()) return FLASHFAT_OK;
+    }
+    if(_compact_from >= _compact_end){
+        // copied, point the entry at the new place
+        FlashFAT_file_entry *file = &_table._files[_compact_file];
+        uint32_t from = file->_start_page * 256;
+        file->_start_page = (_compact_to - (_compact_from - from)) >> 8;
+        uint fi = _compact_file;
+        _compact_file = FLASH_FAT_NO_ERROR_FILE;
+        build_sector_map();
+        _reclaim_sector = from >> 12;
+        _reclaim_end = ((_compact_end - 1) >> 12) + 1;
+        return journal_file(fi);
+    }
+    if(_compact_to >= _compact_erased_to){
+        // destination sector
+        uint32_t sector = _compact_to >> 12;
+        if(!sector_erased(sector)){
+            if(erase_sector(_compact_to) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+        }
+        set_sector_erased(sector, false);
+        _compact_erased_to += 4096;
+        return FLASHFAT_OK;
+    }
+    // write buffers are idle outside WRITE_MODE, copy through the first one
+    byte *page = _write_buffers[0];
+    if(_flash->read(_compact_from, page, 256) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    if(_flash->write_page(_compact_to, page) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    _compact_from += 256;
+    _compact_to += 256;
+    return FLASHFAT_OK;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file FlashFAT_device.hpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief Flash device interface for the FLASH FAT Library
+ * @version 0.1
+ * @date June 2022
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_FAT_DEVICE_HPP_
+#define _FLASH_FAT_DEVICE_HPP_
+
+#ifdef ARDUINO
+    #include <Arduino.h>
+#else
+    // host builds (simulation, benchmarks)
+    #include <stdint.h>
+    #include <string.h>
+    #include <sys/types.h>
+    typedef uint8_t byte;       ///< Arduino byte type
+#endif
+
+#define FLASH_FAT_PAGE_SIZE 256         ///< Program page size of the flash device
+#define FLASH_FAT_SECTOR_SIZE 4096      ///< Smallest erasable unit of the flash device
+#define FLASH_FAT_BLOCK_SIZE 65536      ///< Large erase unit of the flash device
+#define FLASH_FAT_HALF_BLOCK_SIZE 32768 ///< Medium erase unit of the flash device
+
+/**
+ * @brief Status return for flash devices
+ *
+ */
+typedef enum{
+    FLASHFAT_DEVICE_OK = 0,             ///< OK
+    FLASHFAT_DEVICE_BUSY,               ///< Device is busy with a program or erase, command ignored
+    FLASHFAT_DEVICE_FAILURE,            ///< Failed to communicate with the device
+    FLASHFAT_DEVICE_OUT_OF_RANGE,       ///< Address outside of the device
+    FLASHFAT_DEVICE_UNSUPPORTED         ///< Device does not have the command
+}   FlashFAT_device_status_t;
+
+/**
+ * @brief Flash device interface
+ *
+ * Everything FlashFAT needs from a NOR flash chip. Program and erase commands only start the operation
+ * (and handle the write enable themselves), use is_busy() or wait_until_free() before issuing the next command.
+ * Commands issued while the device is busy are ignored by the chip.
+ */
+class FlashFAT_device{
+public:
+    virtual ~FlashFAT_device(){}
+
+    /**
+     * @brief Size of the device
+     *
+     * @return uint32_t     Capacity in bytes
+     */
+    virtual uint32_t capacity() = 0;
+
+    /**
+     * @brief Read a page from the device
+     *
+     * @param address                   Address to start reading from
+     * @param buffer                    Buffer to read into, must hold 256 bytes
+     * @return FlashFAT_device_status_t Return status
+     */
+    virtual FlashFAT_device_status_t read_page(uint32_t address, byte *buffer) = 0;
+
+    /**
+     * @brief Read any length from the device
+     *
+     * Devices that can stream with one read command should override this, the default reads page by page
+     *
+     * @param address                   Address to start reading from
+     * @param buffer                    Buffer to read into
+     * @param length                    Number of bytes to read
+     * @return FlashFAT_device_status_t Return status
+     */
+    virtual FlashFAT_device_status_t read(uint32_t address, byte *buffer, uint32_t length){
+        // whole pages go straight into the buffer
+        while(length >= FLASH_FAT_PAGE_SIZE){
+            FlashFAT_device_status_t status = read_page(address, buffer);
+            if(status != FLASHFAT_DEVICE_OK) return status;
+            address += FLASH_FAT_PAGE_SIZE;
+            buffer += FLASH_FAT_PAGE_SIZE;
+            length -= FLASH_FAT_PAGE_SIZE;
+        }
+        if(length > 0){
+            byte page[FLASH_FAT_PAGE_SIZE];
+            FlashFAT_device_status_t status = read_page(address, page);
+            if(status != FLASHFAT_DEVICE_OK) return status;
+            memcpy(buffer, page, length);
+        }
+        return FLASHFAT_DEVICE_OK;
+    }
+
+    /**
+     * @brief Start programming a page
+     *
+     * @param address                   Page aligned address to program
+     * @param buffer                    Buffer of 256 bytes to program
+     * @return FlashFAT_device_status_t Return status
+     */
+    virtual FlashFAT_device_status_t write_page(uint32_t address, byte *buffer) = 0;
+
+    /**
+     * @brief Start erasing a 4kB sector
+     *
+     * @param address                   Any address in the sector to erase
+     * @return FlashFAT_device_status_t Return status
+     */
+    virtual FlashFAT_device_status_t erase_sector(uint32_t address) = 0;
+
+    /**
+     * @brief Start erasing a 64kB block
+     *
+     * Much faster than 16 sector erases on most chips. Devices without the command keep this default and
+     * FlashFAT falls back to sector erases
+     *
+     * @param address                   Any address in the block to erase
+     * @return FlashFAT_device_status_t Return status, FLASHFAT_DEVICE_UNSUPPORTED without the command
+     */
+    virtual FlashFAT_device_status_t erase_block(uint32_t address){
+        (void)address;
+        return FLASHFAT_DEVICE_UNSUPPORTED;
+    }
+
+    /**
+     * @brief Start erasing a 32kB block
+     *
+     * Same as erase_block(), for chips with the half size block erase
+     *
+     * @param address                   Any address in the block to erase
+     * @return FlashFAT_device_status_t Return status, FLASHFAT_DEVICE_UNSUPPORTED without the command
+     */
+    virtual FlashFAT_device_status_t erase_half_block(uint32_t address){
+        (void)address;
+        return FLASHFAT_DEVICE_UNSUPPORTED;
+    }
+
+    /**
+     * @brief Check if a program or erase is in progress
+     *
+     * @return true     Device is busy
+     * @return false    Device is free
+     */
+    virtual bool is_busy() = 0;
+
+    /**
+     * @brief Block until the device is free
+     *
+     * @return FlashFAT_device_status_t Return status
+     */
+    virtual FlashFAT_device_status_t wait_until_free() = 0;
+
+    /**
+     * @brief Milliseconds clock for time based checkpoints
+     *
+     * millis() on Arduino. Host builds have no clock by default, time based checkpoints never fire
+     *
+     * @return uint32_t     Milliseconds, may wrap
+     */
+    virtual uint32_t time_ms(){
+        #ifdef ARDUINO
+            return millis();
+        #else
+            return 0;
+        #endif
+    }
+};
+
+#endif
@@ -0,0 +1,793 @@
+#include "FlashFAT.hpp"
+
+/*
+    The FAT lives in a journal at the front of the device. Every change appends a small record, when the journal
+    is full the whole table is written to the next journal area with a higher sequence number. The old area stays
+    valid until service() erases it, so a rewrite that loses power falls back to the old area at mount.
+
+    Record:     type (1) | payload length (2) | payload | CRC16 of everything before (2)
+    Multi-byte fields are big-endian. An erased type byte (0xFF) marks the end of the journal.
+
+    A journal area always starts with a HEADER record ('FLASHFAT' + format version + sequence) followed by a TABLE
+    record and a WEAR record. Mount uses the area with the highest sequence whose table is intact.
+
+    ERASED records save which free sectors are known to be erased. File records after one take their sectors
+    back out, and the file still open at power loss may have written anywhere past its start.
+
+    PROGRESS records bound how far the open file got. Pages past the saved end are only programmed after the next
+    record, so at mount everything between the saved length and the saved end is file data then erased flash.
+*/
+
+#define FLASH_FAT_FORMAT_VERSION 8          ///< On-flash format version, 1 was the single page table
+#define FLASH_FAT_FORMAT_VERSION_16BIT 3    ///< Last version with 16 bit page fields, still readable
+
+#define FLASH_FAT_RECORD_EMPTY 0xFF         ///< Erased flash, end of the journal
+#define FLASH_FAT_RECORD_HEADER 0x01        ///< Journal header: 'FLASHFAT' + version + sequence
+#define FLASH_FAT_RECORD_TABLE 0x02         ///< Whole table: file count, close error, every entry
+#define FLASH_FAT_RECORD_FILE 0x03          ///< One entry changed: file count, close error, index, entry
+#define FLASH_FAT_RECORD_COUNT 0x04         ///< File count changed: file count, close error
+#define FLASH_FAT_RECORD_DELETE 0x05        ///< Entry removed, later ones move down: file count, close error, index
+#define FLASH_FAT_RECORD_WEAR 0x06          ///< Erase counters: allocation cursor, counter count, every counter
+#define FLASH_FAT_RECORD_ERASED 0x07        ///< Erased map: first byte, byte count, the bytes, all other sectors unknown
+#define FLASH_FAT_RECORD_PROGRESS 0x08      ///< Open file: index, programmed length, end of its erased space
+
+#define FLASH_FAT_RECORD_OVERHEAD 5         ///< Type, length and CRC bytes around the payload
+#define FLASH_FAT_ENTRY_BYTES 9             ///< Bytes per file entry in a record
+#define FLASH_FAT_ENTRY_BYTES_16BIT 5       ///< Bytes per file entry in a version 3 record
+#define FLASH_FAT_HEADER_BYTES (3 + 13 + 2) ///< Whole header record
+
+#define FLASH_FAT_JOURNAL_SIZE (FLASH_FAT_JOURNAL_SECTORS * 4096UL)    ///< Size of one journal area
+
+/**
+ * @brief CRC-16/CCITT
+ *
+ * @param crc       Running CRC, start with 0xFFFF
+ * @param data      Bytes to add
+ * @param length    Number of bytes
+ * @return uint16_t Updated CRC
+ */
+static uint16_t crc16(uint16_t crc, const byte *data, uint length){
+    for(uint i = 0; i < length; i ++){
+        crc ^= (uint16_t)data[i] << 8;
+        for(uint b = 0; b < 8; b ++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Streams bytes into the journal, programming a page at a time
+ *
+ * Bytes of the page outside of what was put are left at 0xFF so records already on the page are untouched.
+ */
+class FlashFAT_journal_writer{
+public:
+    FlashFAT_journal_writer(FlashFAT_device *flash, uint32_t address){
+        _flash = flash;
+        _address = address;
+        memset(_page, 0xFF, 256);
+    }
+
+    void put(const byte *data, uint length){
+        _crc = crc16(_crc, data, length);
+        while(length > 0){
+            _page[_address % 256] = *data++;
+            _address ++;
+            length --;
+            if(_address % 256 == 0) flush();
+        }
+    }
+
+    void put_u8(uint8_t value){
+        put(&value, 1);
+    }
+
+    void put_u16(uint16_t value){
+        byte buffer[2] = {(byte)(value >> 8), (byte)value};
+        put(buffer, 2);
+    }
+
+    void put_u32(uint32_t value){
+        put_u16(value >> 16);
+        put_u16(value);
+    }
+
+    /**
+     * @brief Start a record
+     *
+     * @param type      Record type
+     * @param length    Payload length
+     */
+    void begin_record(uint8_t type, uint16_t length){
+        _crc = 0xFFFF;
+        put_u8(type);
+        put_u16(length);
+    }
+
+    /**
+     * @brief Close the record with its CRC and program what is left
+     *
+     * @return FlashFAT_status_t    Return Status
+     */
+    FlashFAT_status_t end_record(){
+        put_u16(_crc);
+        if(_address % 256 != 0) flush();
+        return _status;
+    }
+
+    uint32_t address(){ return _address; }
+
+private:
+    FlashFAT_device *_flash;        ///< Device to program
+    uint32_t _address;              ///< Next address to put a byte at
+    byte _page[256];                ///< Page being built
+    uint16_t _crc = 0xFFFF;         ///< CRC of the record so far
+    FlashFAT_status_t _status = FLASHFAT_OK;
+
+    void flush(){
+        uint32_t page_address = ((_address - 1) / 256) * 256;
+        _flash->wait_until_free();
+        if(_flash->write_page(page_address, _page) != FLASHFAT_DEVICE_OK) _status = FLASHFAT_FLASH_FAILURE;
+        memset(_page, 0xFF, 256);
+    }
+};
+
+/**
+ * @brief Reads the journal through a one page cache
+ *
+ */
+class FlashFAT_journal_reader{
+public:
+    FlashFAT_journal_reader(FlashFAT_device *flash, uint32_t address, uint32_t end){
+        _flash = flash;
+        _address = address;
+        _end = end;
+    }
+
+    /**
+     * @brief Read bytes, adding them to the CRC
+     *
+     * @return true     Bytes read
+     * @return false    Past the end of the journal or flash failure
+     */
+    bool get(byte *data, uint length){
+        if(_address + length > _end) return false;
+        while(length > 0){
+            uint32_t page_address = _address & ~(uint32_t)255;
+            if(page_address != _page_address){
+                if(_flash->read(page_address, _page, 256) != FLASHFAT_DEVICE_OK) return false;
+                _page_address = page_address;
+            }
+            uint offset = _address - page_address;
+            uint chunk = 256 - offset;
+            if(chunk > length) chunk = length;
+            memcpy(data, &_page[offset], chunk);
+            _crc = crc16(_crc, data, chunk);
+            data += chunk;
+            _address += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    bool get_u8(uint8_t *value){
+        return get(value, 1);
+    }
+
+    bool get_u16(uint16_t *value){
+        byte buffer[2];
+        if(!get(buffer, 2)) return false;
+        *value = buffer[0] << 8 | buffer[1];
+        return true;
+    }
+
+    bool get_u32(uint32_t *value){
+        byte buffer[4];
+        if(!get(buffer, 4)) return false;
+        *value = (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+        return true;
+    }
+
+    /**
+     * @brief Check that the rest of the current page is erased
+     *
+     * @return true     Every byte up to the end of the page is 0xFF
+     * @return false    Something was programmed, or flash failure
+     */
+    bool erased_to_page_end(){
+        byte value;
+        do{
+            if(!get(&value, 1) || value != 0xFF) return false;
+        } while(_address % 256 != 0);
+        return true;
+    }
+
+    void reset_crc(){ _crc = 0xFFFF; }
+    uint16_t crc(){ return _crc; }
+    uint32_t address(){ return _address; }
+    void seek(uint32_t address){ _address = address; }
+
+private:
+    FlashFAT_device *_flash;                ///< Device to read
+    uint32_t _address;                      ///< Next address to read
+    uint32_t _end;                          ///< End of the journal
+    uint32_t _page_address = 0xFFFFFFFF;    ///< Address of the cached page
+    byte _page[256];                        ///< Cached page
+    uint16_t _crc = 0xFFFF;                 ///< CRC of the bytes read since reset_crc()
+};
+
+/**
+ * @brief Read one file entry
+ *
+ * @param entry_bytes   Size of the entry, version 3 used 16 bit page fields
+ */
+static bool get_entry(FlashFAT_journal_reader &reader, FlashFAT_file_entry *entry, uint entry_bytes){
+    byte buffer[FLASH_FAT_ENTRY_BYTES];
+    if(!reader.get(buffer, entry_bytes)) return false;
+    if(entry_bytes == FLASH_FAT_ENTRY_BYTES_16BIT){
+        entry->_start_page = buffer[0] << 8 | buffer[1];
+        entry->_page_length = buffer[2] << 8 | buffer[3];
+        entry->_end_offset = buffer[4];
+        return true;
+    }
+    entry->_start_page = (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+    entry->_page_length = (uint32_t)buffer[4] << 24 | (uint32_t)buffer[5] << 16 | buffer[6] << 8 | buffer[7];
+    entry->_end_offset = buffer[8];
+    return true;
+}
+
+/**
+ * @brief Write one file entry
+ *
+ */
+static void put_entry(FlashFAT_journal_writer &writer, FlashFAT_file_entry *entry){
+    writer.put_u32(entry->_start_page);
+    writer.put_u32(entry->_page_length);
+    writer.put_u8(entry->_end_offset);
+}
+
+FlashFAT_status_t FlashFAT::read_file_allocation_table(FlashFAT_file_allocation_table *table){
+    // read the file allocation table from the device
+    /*
+        The File Allocation Table is always located at the front of the device
+        It is identified as a header record with 'FLASHFAT' at the start of a journal area
+        If this is not found, there is no FAT.
+    */
+    _flash->wait_until_free();
+    // newest intact area wins, a version 1 table is only looked for without one
+    uint32_t tried = 0;
+    for(uint attempt = 0; attempt < FLASH_FAT_JOURNAL_AREAS; attempt ++){
+        int newest = -1;
+        uint32_t newest_sequence = 0;
+        uint8_t newest_version = 0;
+        for(uint area = 0; area < FLASH_FAT_JOURNAL_AREAS; area ++){
+            uint32_t sequence;
+            uint8_t version;
+            if(tried & (1UL << area)) continue;
+            if(!read_journal_header(area * FLASH_FAT_JOURNAL_SIZE, &sequence, &version)) continue;
+            if(newest < 0 || sequence > newest_sequence){
+                newest = area;
+                newest_sequence = sequence;
+                newest_version = version;
+            }
+        }
+        if(newest < 0) break;
+        tried |= 1UL << newest;
+        uint entry_bytes = newest_version == FLASH_FAT_FORMAT_VERSION_16BIT ? FLASH_FAT_ENTRY_BYTES_16BIT : FLASH_FAT_ENTRY_BYTES;
+        FlashFAT_status_t status = replay_journal(newest * FLASH_FAT_JOURNAL_SIZE, table, entry_bytes);
+        if(status == FLASHFAT_FLASH_FAILURE) return status;
+        if(status != FLASHFAT_OK) continue;
+        _journal_base = newest * FLASH_FAT_JOURNAL_SIZE;
+        _journal_sequence = newest_sequence;
+        // the next area might still need erasing
+        _standby_erased = 0;
+        if(is_erased(journal_standby_base(), FLASH_FAT_JOURNAL_SIZE)) _standby_erased = FLASH_FAT_JOURNAL_SECTORS;
+        // move older formats over to the current one
+        if(newest_version != FLASH_FAT_FORMAT_VERSION) return write_file_allocation_table(table);
+        return FLASHFAT_OK;
+    }
+    char prefix[8];
+    if(_flash->read(0, (byte *)prefix, 8) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    if(strncmp(prefix, "FLASHFAT", 8) == 0){
+        // single page table from version 1
+        return get_legacy_file_allocation_table(table);
+    }
+    #ifdef FLASH_FAT_SERIAL_DEBUG
+        Serial.println("FLASHFAT NO FAT FOUND");
+    #endif
+    return FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND;
+}
+
+bool FlashFAT::read_journal_header(uint32_t base, uint32_t *sequence, uint8_t *version){
+    byte header[FLASH_FAT_HEADER_BYTES];
+    if(_flash->read(base, header, sizeof(header)) != FLASHFAT_DEVICE_OK) return false;
+    if(header[0] != FLASH_FAT_RECORD_HEADER || header[1] != 0 || header[2] != 13) return false;
+    if(strncmp((char *)&header[3], "FLASHFAT", 8) != 0) return false;
+    if(header[11] < FLASH_FAT_FORMAT_VERSION_16BIT || header[11] > FLASH_FAT_FORMAT_VERSION) return false;
+    if(crc16(0xFFFF, header, 16) != (header[16] << 8 | header[17])) return false;
+    *sequence = (uint32_t)header[12] << 24 | (uint32_t)header[13] << 16 | header[14] << 8 | header[15];
+    *version = header[11];
+    return true;
+}
+
+uint32_t FlashFAT::journal_standby_base(){
+    return (_journal_base + FLASH_FAT_JOURNAL_SIZE) % (FLASH_FAT_JOURNAL_AREAS * FLASH_FAT_JOURNAL_SIZE);
+}
+
+FlashFAT_status_t FlashFAT::replay_journal(uint32_t base, FlashFAT_file_allocation_table *table, uint entry_bytes){
+    uint32_t journal_end = base + FLASH_FAT_JOURNAL_SIZE;
+    FlashFAT_journal_reader reader(_flash, base + FLASH_FAT_HEADER_BYTES, journal_end);
+    table->_num_files = 0;
+    table->_file_close_err = FLASH_FAT_NO_ERROR_FILE;
+    memset(_erase_counts, 0, sizeof(_erase_counts));
+    memset(_erased_map, 0, sizeof(_erased_map));
+    _erased_journaled = false;
+    _allocation_cursor = 0;
+    _open_length = 0;
+    _open_extent = 0;
+    bool have_table = false;
+    // replay every record
+    while(reader.address() < journal_end){
+        uint32_t record_address = reader.address();
+        reader.reset_crc();
+        uint8_t type = FLASH_FAT_RECORD_EMPTY;
+        uint16_t length = 0;
+        bool ok = reader.get_u8(&type) && type != FLASH_FAT_RECORD_EMPTY && reader.get_u16(&length) &&
+            record_address + FLASH_FAT_RECORD_OVERHEAD + length <= journal_end;
+        // read the record into locals, only apply it once the CRC checks out
+        uint16_t num_files = 0, close_err = 0, index = 0;
+        uint32_t cursor = 0, extent = 0;
+        FlashFAT_file_entry entry;
+        if(!ok){
+            // not a record
+        }
+        else if(type == FLASH_FAT_RECORD_TABLE){
+            // big, parse straight into the table
+            ok = reader.get_u16(&num_files) && reader.get_u16(&close_err) && num_files <= FLASH_FAT_MAX_FILE_COUNT &&
+                length == 4 + num_files * entry_bytes;
+            for(uint i = 0; ok && i < num_files; i ++) ok = get_entry(reader, &table->_files[i], entry_bytes);
+        }
+        else if(type == FLASH_FAT_RECORD_FILE){
+            ok = length == 6 + entry_bytes && reader.get_u16(&num_files) && reader.get_u16(&close_err) &&
+                reader.get_u16(&index) && get_entry(reader, &entry, entry_bytes) && index < num_files && num_files <= FLASH_FAT_MAX_FILE_COUNT;
+        }
+        else if(type == FLASH_FAT_RECORD_COUNT){
+            ok = length == 4 && reader.get_u16(&num_files) && reader.get_u16(&close_err) && num_files <= FLASH_FAT_MAX_FILE_COUNT;
+        }
+        else if(type == FLASH_FAT_RECORD_DELETE){
+            ok = length == 6 && reader.get_u16(&num_files) && reader.get_u16(&close_err) && reader.get_u16(&index) &&
+                num_files + 1 == table->_num_files && index <= num_files;
+        }
+        else if(type == FLASH_FAT_RECORD_WEAR){
+            // counters are applied after the CRC checks out, skip them for now
+            ok = reader.get_u32(&cursor) && reader.get_u16(&index) && length == 6 + index * 4UL;
+            byte skip[16];
+            for(uint remaining = index * 4UL; ok && remaining > 0; ){
+                uint chunk = remaining < sizeof(skip) ? remaining : sizeof(skip);
+                ok = reader.get(skip, chunk);
+                remaining -= chunk;
+            }
+        }
+        else if(type == FLASH_FAT_RECORD_ERASED){
+            // same for the map, index is the first byte and num_files the byte count
+            ok = reader.get_u16(&index) && reader.get_u16(&num_files) && length == 4 + num_files;
+            byte skip[16];
+            for(uint remaining = num_files; ok && remaining > 0; ){
+                uint chunk = remaining < sizeof(skip) ? remaining : sizeof(skip);
+                ok = reader.get(skip, chunk);
+                remaining -= chunk;
+            }
+        }
+        else if(type == FLASH_FAT_RECORD_PROGRESS){
+            // cursor is the programmed length
+            ok = length == 10 && reader.get_u16(&index) && reader.get_u32(&cursor) && reader.get_u32(&extent);
+        }
+        else{
+            // unknown record, skip it
+            byte skip[16];
+            for(uint remaining = length; ok && remaining > 0; ){
+                uint chunk = remaining < sizeof(skip) ? remaining : sizeof(skip);
+                ok = reader.get(skip, chunk);
+                remaining -= chunk;
+            }
+        }
+        uint16_t crc = reader.crc();
+        uint16_t stored;
+        if(ok && reader.get_u16(&stored) && stored == crc){
+            if(type == FLASH_FAT_RECORD_TABLE) have_table = true;
+            if(type == FLASH_FAT_RECORD_FILE){
+                table->_files[index] = entry;
+                // written since the erased map was saved, a file still open at the end is handled below
+                uint32_t end = ((entry._start_page + entry._page_length) * 256 + entry._end_offset + 4095) >> 12;
+                for(uint32_t sector = entry._start_page >> 4; sector < end; sector ++) set_sector_erased(sector, false);
+            }
+            if(type == FLASH_FAT_RECORD_DELETE){
+                for(uint i = index; i < num_files; i ++) table->_files[i] = table->_files[i + 1];
+            }
+            if(type == FLASH_FAT_RECORD_WEAR){
+                // a different FLASH_FAT_WEAR_GROUP_SECTORS keeps what lines up
+                uint32_t next = reader.address();
+                reader.seek(record_address + 3 + 6);
+                for(uint i = 0; i < index && i < FLASH_FAT_WEAR_GROUPS; i ++) reader.get_u32(&_erase_counts[i]);
+                reader.seek(next);
+                _allocation_cursor = cursor;
+            }
+            if(type == FLASH_FAT_RECORD_ERASED){
+                // replaces the whole map
+                uint32_t next = reader.address();
+                reader.seek(record_address + 3 + 4);
+                memset(_erased_map, 0, sizeof(_erased_map));
+                for(uint i = index; i < (uint)index + num_files && i < sizeof(_erased_map); i ++) reader.get_u8(&_erased_map[i]);
+                reader.seek(next);
+                _erased_journaled = num_files > 0;
+                continue;
+            }
+            if(type == FLASH_FAT_RECORD_PROGRESS){
+                // only good for the file that was open when it was written
+                if(index == table->_file_close_err){
+                    _open_length = cursor;
+                    _open_extent = extent;
+                }
+                continue;
+            }
+            if(type == FLASH_FAT_RECORD_TABLE || type == FLASH_FAT_RECORD_FILE || type == FLASH_FAT_RECORD_COUNT ||
+                type == FLASH_FAT_RECORD_DELETE){
+                table->_num_files = num_files;
+                table->_file_close_err = close_err;
+                // a new file starts with nothing written
+                _open_length = 0;
+                _open_extent = 0;
+            }
+            continue;
+        }
+        // end of the journal if the rest of the page is still erased
+        reader.seek(record_address);
+        if(type == FLASH_FAT_RECORD_EMPTY && reader.erased_to_page_end()){
+            reader.seek(record_address);
+            break;
+        }
+        // torn record, appends carried on at the next page
+        #ifdef FLASH_FAT_SERIAL_DEBUG
+            Serial.println("FLASHFAT TORN JOURNAL RECORD");
+        #endif
+        if(type == FLASH_FAT_RECORD_TABLE) return FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND;
+        reader.seek((record_address & ~(uint32_t)255) + 256);
+    }
+    if(!have_table) return FLASHFAT_FILE_ALLOCATION_TABLE_NOT_FOUND;
+    if(table->_file_close_err >= table->_num_files) table->_file_close_err = FLASH_FAT_NO_ERROR_FILE;
+    if(table->_file_close_err != FLASH_FAT_NO_ERROR_FILE){
+        // the open file may have written anywhere past its start
+        for(uint32_t sector = table->_files[table->_file_close_err]._start_page >> 4; sector < FLASH_FAT_MAX_SECTORS; sector ++){
+            set_sector_erased(sector, false);
+        }
+    }
+    _journal_index = reader.address();
+    return FLASHFAT_OK;
+}
+
+FlashFAT_status_t FlashFAT::get_legacy_file_allocation_table(FlashFAT_file_allocation_table *table){
+    byte buffer[256];
+    FlashFAT_device_status_t status = _flash->read_page(0, buffer);
+    if(status != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    uint index = 8;
+    table->_num_files = buffer[index];
+    index ++;
+    table->_file_close_err = buffer[index];
+    index ++;
+    // the old format overflowed the page past 49 files
+    if(table->_num_files > (256 - 10) / 5) table->_num_files = (256 - 10) / 5;
+    for(uint i = 0; i < table->_num_files; i ++){
+        table->_files[i]._start_page = buffer[index]<<8 | buffer[index+1];
+        index += 2;
+        table->_files[i]._page_length = buffer[index]<<8 | buffer[index+1];
+        index += 2;
+        table->_files[i]._end_offset = buffer[index];
+        index ++;
+    }
+    table->_file_close_err = FLASH_FAT_NO_ERROR_FILE;
+    // the next area after the first is clear of the old table on page 0
+    _journal_base = 0;
+    _journal_sequence = 0;
+    _standby_erased = 0;
+    // files in what is now the journal go above it first, the old table stays in charge until the journal is written
+    FlashFAT_status_t fat_status = move_legacy_files(table);
+    if(fat_status != FLASHFAT_OK) return fat_status;
+    fat_status = write_file_allocation_table(table);
+    if(fat_status != FLASHFAT_OK) return fat_status;
+    // programming the prefix to zero keeps the old table from being migrated again if the journal is lost
+    byte *page = _write_buffers[0];
+    memset(page, 0xFF, 256);
+    memset(page, 0, 8);
+    _flash->wait_until_free();
+    if(_flash->write_page(0, page) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    _flash->wait_until_free();
+    return FLASHFAT_OK;
+}
+
+FlashFAT_status_t FlashFAT::move_legacy_files(FlashFAT_file_allocation_table *table){
+    // version 1 wrote its files one after the other, the copies go after the last one
+    uint32_t copy_start = FLASH_FAT_DATA_START;
+    for(uint i = 0; i < table->_num_files; i ++){
+        uint32_t end = (table->_files[i]._start_page + table->_files[i]._page_length) * 256 + table->_files[i]._end_offset;
+        end = (end + 4095) & ~(uint32_t)4095;
+        if(end > copy_start) copy_start = end;
+    }
+    // a power loss after the copies can have erased sources while writing the journal, so copies that check out
+    // page by page against their source or an erased source are done. Once the journal header is down its area no
+    // longer holds sources at all
+    uint32_t journal = journal_standby_base();
+    uint32_t sequence;
+    uint8_t version;
+    bool journal_started = read_journal_header(journal, &sequence, &version);
+    bool copied = true;
+    uint32_t copy = copy_start;
+    for(uint i = 0; i < table->_num_files; i ++){
+        uint32_t start = table->_files[i]._start_page * 256;
+        if(start >= FLASH_FAT_DATA_START) continue;
+        uint32_t pages = table->_files[i]._page_length + (table->_files[i]._end_offset > 0);
+        if(copy + pages * 256 > sector_count() * 4096UL) return FLASHFAT_LEGACY_NO_SPACE;
+        for(uint32_t p = 0; copied && p < pages; p ++){
+            if(journal_started && start + p * 256 >= journal && start + p * 256 < journal + FLASH_FAT_JOURNAL_SIZE) continue;
+            byte *source = _write_buffers[0];
+            byte *destination = _write_buffers[0] + 256;
+            _flash->wait_until_free();
+            if(_flash->read(start + p * 256, source, 256) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+            if(_flash->read(copy + p * 256, destination, 256) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+            bool erased = true;
+            for(uint b = 0; erased && b < 256; b ++) erased = source[b] == 0xFF;
+            copied = erased || memcmp(source, destination, 256) == 0;
+        }
+        copy = (copy + pages * 256 + 4095) & ~(uint32_t)4095;
+    }
+    copy = copy_start;
+    for(uint i = 0; i < table->_num_files; i ++){
+        uint32_t start = table->_files[i]._start_page * 256;
+        if(start >= FLASH_FAT_DATA_START) continue;
+        uint32_t pages = table->_files[i]._page_length + (table->_files[i]._end_offset > 0);
+        for(uint32_t p = 0; !copied && p < pages; p ++){
+            if(((copy + p * 256) & 4095) == 0){
+                _flash->wait_until_free();
+                if(erase_sector(copy + p * 256) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+            }
+            byte *page = _write_buffers[0];
+            _flash->wait_until_free();
+            if(_flash->read(start + p * 256, page, 256) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+            if(_flash->write_page(copy + p * 256, page) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+        }
+        table->_files[i]._start_page = copy >> 8;
+        copy = (copy + pages * 256 + 4095) & ~(uint32_t)4095;
+    }
+    _flash->wait_until_free();
+    return FLASHFAT_OK;
+}
+
+FlashFAT_status_t FlashFAT::write_file_allocation_table(FlashFAT_file_allocation_table *table){
+    // start the next journal area with the whole table, the current one stays valid until this is done
+    uint32_t base = journal_standby_base();
+    _flash->wait_until_free();
+    for(uint s = _standby_erased; s < FLASH_FAT_JOURNAL_SECTORS; s ++){
+        if(erase_sector(base + s * 4096) != FLASHFAT_DEVICE_OK){
+            #ifdef FLASH_FAT_SERIAL_DEBUG
+                Serial.println("FLASHFAT CHIP FAILED TO ERASE");
+            #endif
+            return FLASHFAT_FLASH_FAILURE;
+        }
+        _flash->wait_until_free();
+    }
+    FlashFAT_journal_writer writer(_flash, base);
+    writer.begin_record(FLASH_FAT_RECORD_HEADER, 13);
+    writer.put((const byte *)"FLASHFAT", 8);
+    writer.put_u8(FLASH_FAT_FORMAT_VERSION);
+    writer.put_u32(_journal_sequence + 1);
+    writer.end_record();
+    writer.begin_record(FLASH_FAT_RECORD_TABLE, 4 + table->_num_files * FLASH_FAT_ENTRY_BYTES);
+    writer.put_u16(table->_num_files);
+    writer.put_u16(table->_file_close_err);
+    for(uint i = 0; i < table->_num_files; i ++) put_entry(writer, &table->_files[i]);
+    writer.end_record();
+    writer.begin_record(FLASH_FAT_RECORD_WEAR, 6 + FLASH_FAT_WEAR_GROUPS * 4);
+    writer.put_u32(_allocation_cursor);
+    writer.put_u16(FLASH_FAT_WEAR_GROUPS);
+    for(uint i = 0; i < FLASH_FAT_WEAR_GROUPS; i ++) writer.put_u32(_erase_counts[i]);
+    FlashFAT_status_t status = writer.end_record();
+    uint first, end;
+    erased_bytes(&first, &end);
+    if(status == FLASHFAT_OK && end > first){
+        writer.begin_record(FLASH_FAT_RECORD_ERASED, 4 + end - first);
+        writer.put_u16(first);
+        writer.put_u16(end - first);
+        for(uint i = first; i < end; i ++) writer.put_u8(erased_byte(i));
+        status = writer.end_record();
+    }
+    if(status == FLASHFAT_OK && _mode == FLASHFAT_WRITE_MODE && _journaled_extent > 0){
+        // the table record dropped the open file's progress
+        writer.begin_record(FLASH_FAT_RECORD_PROGRESS, 10);
+        writer.put_u16(_file_index);
+        writer.put_u32((_synced_end > _current_index ? _synced_end : _current_index) - _table._files[_file_index]._start_page * 256);
+        writer.put_u32(_journaled_extent);
+        status = writer.end_record();
+    }
+    if(status != FLASHFAT_OK){
+        #ifdef FLASH_FAT_SERIAL_DEBUG
+            Serial.println("FLASHFAT CHIP FAILED TO WRITE FAT TABLE");
+        #endif
+        _standby_erased = 0;
+        return status;
+    }
+    // commit, the old area is erased later by service()
+    _journal_base = base;
+    _journal_sequence ++;
+    _journal_index = writer.address();
+    _standby_erased = 0;
+    _unsaved_erases = 0;
+    _erased_journaled = end > first;
+    return FLASHFAT_OK;
+}
+
+FlashFAT_status_t FlashFAT::erase_journal_standby(){
+    if(_standby_erased >= FLASH_FAT_JOURNAL_SECTORS) return FLASHFAT_OK;
+    if(_flash->is_busy()) return FLASHFAT_OK;
+    if(erase_sector(journal_standby_base() + _standby_erased * 4096) != FLASHFAT_DEVICE_OK) return FLASHFAT_FLASH_FAILURE;
+    _standby_erased ++;
+    return FLASHFAT_OK;
+}
+
+bool FlashFAT::journal_fits(uint16_t length){
+    return !_table_dirty && _journal_index + FLASH_FAT_RECORD_OVERHEAD + length <= _journal_base + FLASH_FAT_JOURNAL_SIZE;
+}
+
+bool FlashFAT::progress_ready(){
+    // a rewrite into an unerased standby area erases it first
+    return journal_fits(10) || _standby_erased >= FLASH_FAT_JOURNAL_SECTORS;
+}
+
+FlashFAT_status_t FlashFAT::journal_file(uint fi){
+    uint16_t length = 6 + FLASH_FAT_ENTRY_BYTES;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        return rewrite_table();
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_FILE, length);
+    writer.put_u16(_table._num_files);
+    writer.put_u16(_table._file_close_err);
+    writer.put_u16(fi);
+    put_entry(writer, &_table._files[fi]);
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    // the cache is ahead of the flash until the next rewrite
+    if(status != FLASHFAT_OK) _table_dirty = true;
+    return status;
+}
+
+FlashFAT_status_t FlashFAT::journal_count(){
+    uint16_t length = 4;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        return rewrite_table();
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_COUNT, length);
+    writer.put_u16(_table._num_files);
+    writer.put_u16(_table._file_close_err);
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    // the cache is ahead of the flash until the next rewrite
+    if(status != FLASHFAT_OK) _table_dirty = true;
+    return status;
+}
+
+FlashFAT_status_t FlashFAT::journal_delete(uint fi){
+    uint16_t length = 6;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        return rewrite_table();
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_DELETE, length);
+    writer.put_u16(_table._num_files);
+    writer.put_u16(_table._file_close_err);
+    writer.put_u16(fi);
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    // the cache is ahead of the flash until the next rewrite
+    if(status != FLASHFAT_OK) _table_dirty = true;
+    return status;
+}
+
+FlashFAT_status_t FlashFAT::journal_wear(){
+    uint16_t length = 6 + FLASH_FAT_WEAR_GROUPS * 4;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        return rewrite_table();
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_WEAR, length);
+    writer.put_u32(_allocation_cursor);
+    writer.put_u16(FLASH_FAT_WEAR_GROUPS);
+    for(uint i = 0; i < FLASH_FAT_WEAR_GROUPS; i ++) writer.put_u32(_erase_counts[i]);
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    if(status == FLASHFAT_OK) _unsaved_erases = 0;
+    // the cache is ahead of the flash until the next rewrite
+    else _table_dirty = true;
+    return status;
+}
+
+byte FlashFAT::erased_byte(uint i){
+    byte value = _erased_map[i];
+    if(_compact_file == FLASH_FAT_NO_ERROR_FILE) return value;
+    // the move in progress writes its destination before the file record
+    uint32_t skip_start = _compact_to >> 12;
+    uint32_t skip_end = (_compact_to + (_compact_end - _compact_from) + 4095) >> 12;
+    for(uint b = 0; b < 8; b ++){
+        if(i * 8 + b >= skip_start && i * 8 + b < skip_end) value &= ~(1 << b);
+    }
+    return value;
+}
+
+void FlashFAT::erased_bytes(uint *first, uint *end){
+    *first = 0;
+    *end = 0;
+    for(uint i = 0; i < sizeof(_erased_map); i ++){
+        if(erased_byte(i) == 0) continue;
+        if(*end == 0) *first = i;
+        *end = i + 1;
+    }
+}
+
+FlashFAT_status_t FlashFAT::journal_erased(){
+    uint first, end;
+    erased_bytes(&first, &end);
+    uint16_t length = 4 + end - first;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        return rewrite_table();
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_ERASED, length);
+    writer.put_u16(first);
+    writer.put_u16(end - first);
+    for(uint i = first; i < end; i ++) writer.put_u8(erased_byte(i));
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    if(status == FLASHFAT_OK) _erased_journaled = end > first;
+    // the cache is ahead of the flash until the next rewrite
+    else _table_dirty = true;
+    return status;
+}
+
+FlashFAT_status_t FlashFAT::journal_progress(){
+    // erased sectors past the erase cursor can't hold old data either
+    uint32_t extent = _erase_index + 1;
+    while((extent & 4095) == 0 && extent < _allocation_end && sector_erased(extent >> 12)) extent += 4096;
+    uint32_t previous = _journaled_extent;
+    _journaled_extent = extent;
+    uint16_t length = 10;
+    if(!journal_fits(length)){
+        // journal is full or missed a change, start over with the whole table
+        FlashFAT_status_t status = rewrite_table();
+        if(status != FLASHFAT_OK) _journaled_extent = previous;
+        return status;
+    }
+    FlashFAT_journal_writer writer(_flash, _journal_index);
+    writer.begin_record(FLASH_FAT_RECORD_PROGRESS, length);
+    writer.put_u16(_file_index);
+    writer.put_u32((_synced_end > _current_index ? _synced_end : _current_index) - _table._files[_file_index]._start_page * 256);
+    writer.put_u32(extent);
+    FlashFAT_status_t status = writer.end_record();
+    _journal_index = writer.address();
+    if(status != FLASHFAT_OK){
+        _journaled_extent = previous;
+        // a record after the torn one would be skipped at mount, the next change rewrites the table
+        _table_dirty = true;
+    }
+    return status;
+}
+
+FlashFAT_status_t FlashFAT::rewrite_table(){
+    FlashFAT_status_t status = write_file_allocation_table(&_table);
+    _table_dirty = status != FLASHFAT_OK;
+    return status;
+}
@@ -0,0 +1,198 @@
+/**
+ * @file FlashFAT_lock.hpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief Locked FlashFAT for use from several threads or RTOS tasks
+ * @version 0.1
+ * @date June 2022
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_FAT_LOCK_HPP_
+#define _FLASH_FAT_LOCK_HPP_
+
+#include "FlashFAT.hpp"
+
+/**
+ * @brief Device with a lock policy in front of it
+ *
+ * Every command holds the lock just for that command, a read also waits out whatever program or erase is in
+ * progress under it so another task can't start one in between. wait_until_free() only takes it to poll, so a
+ * task waiting on an erase doesn't keep the others off the flash. FlashFAT_locked puts one in front of the device
+ * passed to begin()
+ *
+ * @tparam Lock     Lock policy, FlashFAT_std_lock or FlashFAT_freertos_lock
+ */
+template<class Lock>
+class FlashFAT_locked_device : public FlashFAT_device{
+public:
+    /**
+     * @brief Set the device the commands go to
+     *
+     * @param device    Device passed to begin()
+     */
+    void attach(FlashFAT_device *device){ _device = device; }
+
+    uint32_t capacity(){ return _device->capacity(); }
+
+    FlashFAT_device_status_t read_page(uint32_t address, byte *buffer){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->wait_until_free();
+        if(status == FLASHFAT_DEVICE_OK) status = _device->read_page(address, buffer);
+        _lock.unlock();
+        return status;
+    }
+
+    FlashFAT_device_status_t read(uint32_t address, byte *buffer, uint32_t length){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->wait_until_free();
+        if(status == FLASHFAT_DEVICE_OK) status = _device->read(address, buffer, length);
+        _lock.unlock();
+        return status;
+    }
+
+    FlashFAT_device_status_t write_page(uint32_t address, byte *buffer){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->write_page(address, buffer);
+        _lock.unlock();
+        return status;
+    }
+
+    FlashFAT_device_status_t erase_sector(uint32_t address){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->erase_sector(address);
+        _lock.unlock();
+        return status;
+    }
+
+    FlashFAT_device_status_t erase_block(uint32_t address){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->erase_block(address);
+        _lock.unlock();
+        return status;
+    }
+
+    FlashFAT_device_status_t erase_half_block(uint32_t address){
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->erase_half_block(address);
+        _lock.unlock();
+        return status;
+    }
+
+    bool is_busy(){
+        _lock.lock();
+        bool busy = _device->is_busy();
+        _lock.unlock();
+        return busy;
+    }
+
+    FlashFAT_device_status_t wait_until_free(){
+        // other tasks read in between the polls
+        while(is_busy()) _lock.yield();
+        _lock.lock();
+        FlashFAT_device_status_t status = _device->wait_until_free();
+        _lock.unlock();
+        return status;
+    }
+
+    uint32_t time_ms(){ return _device->time_ms(); }
+
+private:
+    FlashFAT_device *_device;   ///< Device passed to begin()
+    Lock _lock;                 ///< Lock policy, only ever held for one command
+};
+
+/**
+ * @brief FlashFAT with a lock policy
+ *
+ * Two locks. The state lock covers the table, the write buffers and the erase cursors, which are only consistent
+ * between calls, so every call holds it from start to end, including while it waits on the flash. The device lock
+ * covers the flash itself and is only held for one command at a time, see FlashFAT_locked_device.
+ *
+ * Reads through FlashFAT_File handles only take the device lock, FLASH_FAT_READ_CHUNK bytes at a time, so a task
+ * reading out an old file keeps going while a task logging to a new one waits on an erase. A read waits at most the
+ * one program or erase in progress, at worst a 64kB block erase (150ms typical, up to 2s on a W25Q64FV). Opening
+ * and closing a handle take the state lock. A handle itself belongs to one task.
+ *
+ * Every other call still waits for the call holding the state lock to finish. At worst that is a write() or
+ * close_file() reaching a block it has to erase, a new_file() erasing its reserve, or a call that journals a change
+ * when the journal area is full and the standby area isn't erased yet, FLASH_FAT_JOURNAL_SECTORS sector erases
+ * (45ms typical, up to 400ms each). set_background_erase() and calling service() often keep these off the other
+ * tasks' path, service() only starts an erase and returns.
+ *
+ * Lock needs lock(), unlock() and yield(), and has to be recursive, calls nest. yield() is called between polls of
+ * a busy flash and has to let every other task run, lower priority ones included, so it has to block rather than
+ * just hand over to tasks of the same priority.
+ *
+ * @tparam Lock     Lock policy, FlashFAT_std_lock or FlashFAT_freertos_lock
+ */
+template<class Lock>
+class FlashFAT_locked : public FlashFAT{
+public:
+    /**
+     * @brief Get the state lock
+     *
+     * Hold it to make several calls in a row without another task getting in between
+     *
+     * @return Lock&    The lock policy
+     */
+    Lock &get_lock(){ return _lock; }
+
+protected:
+    void lock(){ _lock.lock(); }
+    void unlock(){ _lock.unlock(); }
+    FlashFAT_device *wrap_device(FlashFAT_device *device){
+        _device.attach(device);
+        return &_device;
+    }
+
+private:
+    Lock _lock;                             ///< State lock
+    FlashFAT_locked_device<Lock> _device;   ///< Device lock in front of the device passed to begin()
+};
+
+#ifndef ARDUINO
+    #include <mutex>
+    #include <thread>
+
+    /**
+     * @brief Lock policy for host builds using std::thread
+     *
+     * Host schedulers preempt, a yielding poll doesn't keep other threads off the CPU
+     *
+     */
+    class FlashFAT_std_lock{
+    public:
+        void lock(){ _mutex.lock(); }
+        void unlock(){ _mutex.unlock(); }
+        void yield(){ std::this_thread::yield(); }
+
+    private:
+        std::recursive_mutex _mutex;    ///< Underlying mutex
+    };
+#endif
+
+#if defined(INC_FREERTOS_H) && defined(SEMAPHORE_H)
+    /**
+     * @brief Lock policy for FreeRTOS tasks
+     *
+     * Include FreeRTOS.h and semphr.h before this header. Needs configUSE_RECURSIVE_MUTEXES. A call waiting on the
+     * flash polls it once a tick, so each page program it waits on takes at least a tick
+     *
+     */
+    class FlashFAT_freertos_lock{
+    public:
+        FlashFAT_freertos_lock(){ _mutex = xSemaphoreCreateRecursiveMutex(); }
+        ~FlashFAT_freertos_lock(){ vSemaphoreDelete(_mutex); }
+        void lock(){ xSemaphoreTakeRecursive(_mutex, portMAX_DELAY); }
+        void unlock(){ xSemaphoreGiveRecursive(_mutex); }
+        // taskYIELD() would leave lower priority readers starved for a whole erase
+        void yield(){ vTaskDelay(1); }
+
+    private:
+        SemaphoreHandle_t _mutex;       ///< Recursive mutex
+    };
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+#include "FlashFAT.hpp"
+
+/*
+    enqueue() is the producer side of a single-producer single-consumer ring buffer, meant for an interrupt that
+    can't wait on the SPI bus. The head and tail count bytes forever and wrap with FlashFAT_ring_index_t, the ring
+    size being a power of two no larger than half its range keeps head - tail the number of bytes waiting. The
+    producer only writes the head and the consumer only writes the tail, each publishes its own after the bytes are
+    copied, so neither needs the lock. Each side reads the other's counter, so it is one byte on AVR where wider
+    loads take several instructions an interrupt can land between.
+
+    service() is the consumer, under the lock. It moves what is waiting into the write buffers, where it is
+    programmed like any write(). The overrun counters are only written by the producer, the truncated count only
+    by the consumer. AVR has no 4 byte atomics and no libatomic to call for them, there the overrun counters are
+    plain volatile and get_ring_stats() reads them with interrupts off.
+*/
+
+#if FLASH_FAT_RING_BUFFER > 0
+
+static_assert((FlashFAT_ring_index_t)(FLASH_FAT_RING_BUFFER * 2UL - 1) == FLASH_FAT_RING_BUFFER * 2UL - 1,
+    "FLASH_FAT_RING_BUFFER can be at most half the range of FLASH_FAT_RING_INDEX");
+
+/**
+ * @brief Add to an overrun counter, only enqueue() writes them
+ *
+ * @param counter   Counter to add to
+ * @param value     Amount to add
+ */
+static inline void add_overrun(uint32_t *counter, uint32_t value){
+    #ifdef __AVR__
+        *(volatile uint32_t *)counter += value;
+    #else
+        __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+    #endif
+}
+
+/**
+ * @brief Read an overrun counter
+ *
+ * @pre Interrupts off on AVR
+ *
+ * @param counter   Counter to read
+ * @return uint32_t Its value
+ */
+static inline uint32_t load_overrun(uint32_t *counter){
+    #ifdef __AVR__
+        return *(volatile uint32_t *)counter;
+    #else
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+    #endif
+}
+
+bool FlashFAT::enqueue(const byte *buffer, uint length){
+    FlashFAT_ring_index_t head = _ring_head;
+    // the tail only moves forward, the room seen here can only grow before the copy
+    uint waiting = (FlashFAT_ring_index_t)(head - __atomic_load_n(&_ring_tail, __ATOMIC_ACQUIRE));
+    if(length > FLASH_FAT_RING_BUFFER - waiting){
+        // a sample is worth nothing cut short, keep none of it
+        add_overrun(&_ring_overruns, 1);
+        add_overrun(&_ring_overrun_bytes, length);
+        return false;
+    }
+    uint offset = head & (FLASH_FAT_RING_BUFFER - 1);
+    uint first = FLASH_FAT_RING_BUFFER - offset;
+    if(first > length) first = length;
+    memcpy(&_ring[offset], buffer, first);
+    memcpy(_ring, buffer + first, length - first);
+    waiting += length;
+    if(waiting > _ring_peak) __atomic_store_n(&_ring_peak, (FlashFAT_ring_index_t)waiting, __ATOMIC_RELAXED);
+    // publish the bytes once they are in place
+    __atomic_store_n(&_ring_head, (FlashFAT_ring_index_t)(head + length), __ATOMIC_RELEASE);
+    return true;
+}
+
+void FlashFAT::get_ring_stats(FlashFAT_ring_stats *stats){
+    scoped_lock guard(this);
+    #ifdef __AVR__
+        // an interrupt counting an overrun halfway through would tear the 4 byte counters
+        uint8_t sreg = SREG;
+        cli();
+    #endif
+    stats->overruns = load_overrun(&_ring_overruns);
+    stats->overrun_bytes = load_overrun(&_ring_overrun_bytes);
+    #ifdef __AVR__
+        SREG = sreg;
+    #endif
+    stats->truncated_bytes = _ring_truncated;
+    stats->peak = __atomic_load_n(&_ring_peak, __ATOMIC_RELAXED);
+    stats->queued = (FlashFAT_ring_index_t)(__atomic_load_n(&_ring_head, __ATOMIC_ACQUIRE) - _ring_tail);
+}
+
+void FlashFAT::drain_ring(){
+    FlashFAT_ring_index_t tail = _ring_tail;
+    uint waiting = (FlashFAT_ring_index_t)(__atomic_load_n(&_ring_head, __ATOMIC_ACQUIRE) - tail);
+    while(waiting > 0){
+        // the file can't grow into the next used sector, what's left can't go anywhere
+        uint32_t room = _allocation_end - write_end();
+        if(room == 0){
+            _ring_truncated += waiting;
+            tail += waiting;
+            break;
+        }
+        // every buffer is waiting on the flash
+        if(_queued_buffers >= FLASH_FAT_WRITE_BUFFER_COUNT) break;
+        uint offset = tail & (FLASH_FAT_RING_BUFFER - 1);
+        uint chunk = FLASH_FAT_FILE_BUFFER - _write_buffer_index;
+        if(chunk > waiting) chunk = waiting;
+        if(chunk > FLASH_FAT_RING_BUFFER - offset) chunk = FLASH_FAT_RING_BUFFER - offset;
+        if(chunk > room) chunk = room;
+        memcpy(&_write_buffers[_fill_buffer][_write_buffer_index], &_ring[offset], chunk);
+        _write_buffer_index += chunk;
+        tail += chunk;
+        waiting -= chunk;
+        if(_write_buffer_index >= FLASH_FAT_FILE_BUFFER){
+            // queue the buffer
+            _queued_buffers ++;
+            _fill_buffer = (_fill_buffer + 1) % FLASH_FAT_WRITE_BUFFER_COUNT;
+            _write_buffer_index = 0;
+        }
+    }
+    // hand the room back to the producer
+    __atomic_store_n(&_ring_tail, tail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "FlashFAT_sim.hpp"
+
+FlashFAT_sim::FlashFAT_sim(FlashFAT_sim_config config){
+    _config = config;
+    // parts over 16MB need 4 byte addresses
+    _address_bytes = _config.capacity > 16777216UL ? 4 : 3;
+    _memory = new byte[_config.capacity];
+    // chips ship erased
+    memset(_memory, 0xFF, _config.capacity);
+    reset_stats();
+}
+
+FlashFAT_sim::~FlashFAT_sim(){
+    delete[] _memory;
+}
+
+void FlashFAT_sim::transfer(uint32_t bytes){
+    _now_ns += _config.command_overhead_ns + (uint64_t)bytes * 8 * 1000000000ULL / _config.spi_clock_hz;
+}
+
+bool FlashFAT_sim::reject_busy(){
+    if(_now_ns < _busy_until_ns){
+        // the chip only answers status reads while busy
+        _stats.ignored_commands ++;
+        return true;
+    }
+    return false;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::read_page(uint32_t address, byte *buffer){
+    return read(address, buffer, FLASH_FAT_PAGE_SIZE);
+}
+
+FlashFAT_device_status_t FlashFAT_sim::read(uint32_t address, byte *buffer, uint32_t length){
+    if(address >= _config.capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(reject_busy()) return FLASHFAT_DEVICE_BUSY;
+    // one command, the address auto increments
+    transfer(1 + _address_bytes + length);
+    // reads wrap around the end of the chip
+    uint32_t first = _config.capacity - address;
+    if(first > length) first = length;
+    memcpy(buffer, &_memory[address], first);
+    for(uint32_t i = first; i < length; i ++){
+        buffer[i] = _memory[(address + i) % _config.capacity];
+    }
+    _stats.read_commands ++;
+    _stats.read_bytes += length;
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::write_page(uint32_t address, byte *buffer){
+    if(address >= _config.capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(reject_busy()) return FLASHFAT_DEVICE_BUSY;
+    // write enable, then the program command
+    transfer(1);
+    transfer(1 + _address_bytes + FLASH_FAT_PAGE_SIZE);
+    // the page address wraps, same as the real chip
+    uint32_t page = address & ~(uint32_t)(FLASH_FAT_PAGE_SIZE - 1);
+    bool conflict = false;
+    for(uint i = 0; i < FLASH_FAT_PAGE_SIZE; i ++){
+        byte *cell = &_memory[page + ((address + i) & (FLASH_FAT_PAGE_SIZE - 1))];
+        // 0xFF leaves a byte alone, anything else has to stick
+        if(buffer[i] != 0xFF && (*cell & buffer[i]) != buffer[i]) conflict = true;
+        *cell &= buffer[i];
+    }
+    if(conflict) _stats.program_conflicts ++;
+    _stats.page_programs ++;
+    _busy_until_ns = _now_ns + (uint64_t)_config.page_program_us * 1000;
+    return FLASHFAT_DEVICE_OK;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::erase_sector(uint32_t address){
+    FlashFAT_device_status_t status = erase(address, FLASH_FAT_SECTOR_SIZE, _config.sector_erase_us);
+    if(status == FLASHFAT_DEVICE_OK) _stats.sector_erases ++;
+    return status;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::erase_block(uint32_t address){
+    if(_config.block_erase_us == 0) return FLASHFAT_DEVICE_UNSUPPORTED;
+    FlashFAT_device_status_t status = erase(address, FLASH_FAT_BLOCK_SIZE, _config.block_erase_us);
+    if(status == FLASHFAT_DEVICE_OK) _stats.block_erases ++;
+    return status;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::erase_half_block(uint32_t address){
+    if(_config.half_block_erase_us == 0) return FLASHFAT_DEVICE_UNSUPPORTED;
+    FlashFAT_device_status_t status = erase(address, FLASH_FAT_HALF_BLOCK_SIZE, _config.half_block_erase_us);
+    if(status == FLASHFAT_DEVICE_OK) _stats.half_block_erases ++;
+    return status;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::erase(uint32_t address, uint32_t size, uint32_t time_us){
+    if(address >= _config.capacity) return FLASHFAT_DEVICE_OUT_OF_RANGE;
+    if(reject_busy()) return FLASHFAT_DEVICE_BUSY;
+    transfer(1);
+    transfer(1 + _address_bytes);
+    uint32_t start = address & ~(size - 1);
+    // chips smaller than the erase
+    uint32_t length = _config.capacity - start < size ? _config.capacity - start : size;
+    memset(&_memory[start], 0xFF, length);
+    _busy_until_ns = _now_ns + (uint64_t)time_us * 1000;
+    return FLASHFAT_DEVICE_OK;
+}
+
+bool FlashFAT_sim::is_busy(){
+    // read status register
+    transfer(2);
+    _stats.busy_polls ++;
+    return _now_ns < _busy_until_ns;
+}
+
+FlashFAT_device_status_t FlashFAT_sim::wait_until_free(){
+    uint64_t start = _now_ns;
+    if(is_busy()){
+        // skip ahead over the polls a real driver would spin through
+        uint64_t poll_ns = _config.command_overhead_ns + 16ULL * 1000000000ULL / _config.spi_clock_hz;
+        uint64_t polls = (_busy_until_ns - _now_ns + poll_ns - 1) / poll_ns;
+        _now_ns += polls * poll_ns;
+        _stats.busy_polls += polls;
+    }
+    _stats.busy_wait_ns += _now_ns - start;
+    return FLASHFAT_DEVICE_OK;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file FlashFAT_sim.hpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com)
+ * @brief Simulated flash device for the FLASH FAT Library
+ * @version 0.1
+ * @date June 2022
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_FAT_SIM_HPP_
+#define _FLASH_FAT_SIM_HPP_
+
+#include "FlashFAT_device.hpp"
+
+/**
+ * @brief Timing and geometry of the simulated chip
+ *
+ * Defaults are the typical values from the W25Q64FV datasheet
+ */
+typedef struct{
+    uint32_t capacity = 8388608UL;          ///< Size of the chip in bytes, above 16MB uses 4 byte addresses
+    uint32_t spi_clock_hz = 50000000UL;     ///< SPI clock
+    uint32_t command_overhead_ns = 500;     ///< Chip-select and driver overhead per command
+    uint32_t page_program_us = 700;         ///< Page program time (tPP)
+    uint32_t sector_erase_us = 45000;       ///< 4kB sector erase time (tSE)
+    uint32_t half_block_erase_us = 120000;  ///< 32kB block erase time (tBE1), 0 leaves the command out
+    uint32_t block_erase_us = 150000;       ///< 64kB block erase time (tBE2), 0 leaves the command out
+}   FlashFAT_sim_config;
+
+/**
+ * @brief Operation counters of the simulated chip
+ *
+ */
+typedef struct{
+    uint32_t read_commands;         ///< Number of read commands
+    uint32_t read_bytes;            ///< Number of data bytes read
+    uint32_t page_programs;         ///< Number of page programs
+    uint32_t sector_erases;         ///< Number of sector erases
+    uint32_t half_block_erases;     ///< Number of 32kB block erases
+    uint32_t block_erases;          ///< Number of 64kB block erases
+    uint32_t busy_polls;            ///< Number of status register reads
+    uint32_t ignored_commands;      ///< Commands issued while busy
+    uint32_t program_conflicts;     ///< Programs where a byte other than 0xFF tried to set a bit back to 1
+    uint64_t busy_wait_ns;          ///< Time spent blocked in wait_until_free()
+}   FlashFAT_sim_stats;
+
+/**
+ * @brief RAM backed NOR flash chip
+ *
+ * Programs can only clear bits, erases set a whole sector back to 0xFF. Time is virtual: every command advances
+ * the clock by its SPI transfer time and program/erase operations keep the chip busy for their datasheet time.
+ * Use advance() to model time the host spends elsewhere.
+ */
+class FlashFAT_sim : public FlashFAT_device{
+public:
+    /**
+     * @brief Construct a blank (fully erased) chip
+     *
+     * @param config    Geometry and timing
+     */
+    FlashFAT_sim(FlashFAT_sim_config config = FlashFAT_sim_config());
+    ~FlashFAT_sim();
+
+    uint32_t capacity(){ return _config.capacity; }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t read(uint32_t address, byte *buffer, uint32_t length);
+    FlashFAT_device_status_t write_page(uint32_t address, byte *buffer);
+    FlashFAT_device_status_t erase_sector(uint32_t address);
+    FlashFAT_device_status_t erase_block(uint32_t address);
+    FlashFAT_device_status_t erase_half_block(uint32_t address);
+    bool is_busy();
+    FlashFAT_device_status_t wait_until_free();
+    uint32_t time_ms(){ return _now_ns / 1000000; }
+
+    /**
+     * @brief Let time pass without talking to the chip
+     *
+     * @param ns    Nanoseconds to advance
+     */
+    void advance(uint64_t ns){ _now_ns += ns; }
+
+    /**
+     * @brief Current virtual time
+     *
+     * @return uint64_t     Nanoseconds since construction
+     */
+    uint64_t now_ns(){ return _now_ns; }
+
+    /**
+     * @brief Get the operation counters
+     *
+     * @return FlashFAT_sim_stats   Counters since construction or the last reset_stats()
+     */
+    FlashFAT_sim_stats stats(){ return _stats; }
+
+    /**
+     * @brief Clear the operation counters
+     *
+     */
+    void reset_stats(){ memset(&_stats, 0, sizeof(_stats)); }
+
+    /**
+     * @brief Direct access to the chip contents
+     *
+     * @return byte*    Pointer to the start of the array
+     */
+    byte *data(){ return _memory; }
+
+private:
+    FlashFAT_sim_config _config;    ///< Geometry and timing
+    FlashFAT_sim_stats _stats;      ///< Operation counters
+    byte *_memory;                  ///< Chip contents
+    uint64_t _now_ns = 0;           ///< Virtual clock
+    uint64_t _busy_until_ns = 0;    ///< End of the current program or erase
+    uint32_t _address_bytes;        ///< Address bytes per command, 4 above 16MB
+
+    /**
+     * @brief Advance the clock by one SPI transaction
+     *
+     * @param bytes     Bytes clocked out, including command and address
+     */
+    void transfer(uint32_t bytes);
+
+    /**
+     * @brief Check for a command arriving while busy
+     *
+     * @return true     Command must be ignored
+     * @return false    Chip is free
+     */
+    bool reject_busy();
+
+    /**
+     * @brief Start an erase of any power of two size
+     *
+     * @param address   Address in the range to erase
+     * @param size      Erase size
+     * @param time_us   Time the chip stays busy
+     * @return FlashFAT_device_status_t Return status
+     */
+    FlashFAT_device_status_t erase(uint32_t address, uint32_t size, uint32_t time_us);
+};
+
+#endif
@@ -0,0 +1,1875 @@
+/**
+ * @file FlashFAT_test.cpp
+ * @author Jeremy Dunne (jeremymdunne@gmail.com) 
+ * @brief Host regression tests for the FLASH FAT Library 
+ * @version 0.1
+ * @date June 2022
+ * 
+ * Runs FlashFAT against the simulated chip. Every test checks what was read back and that the chip never saw a 
+ * program over unerased bytes. Exits non-zero if any test fails. 
+ * 
+ * Build and run from the repository root: 
+ *      g++ -Isrc -DFLASH_FAT_RING_BUFFER=64 -DFLASH_FAT_RING_INDEX=uint8_t test/FlashFAT_test.cpp src/FlashFAT*.cpp -pthread -o flashfat_test && ./flashfat_test 
+ * 
+ * The small ring with one byte counters is what AVR builds use, its counters wrap every 256 bytes. Also build with 
+ * -DFLASH_FAT_MAX_FILE_COUNT=1000 now and then, the full table test follows the limit. 
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "FlashFAT.hpp"
+#include "FlashFAT_lock.hpp"
+#include "FlashFAT_sim.hpp"
+
+#define CHECK(condition) do{ if(!(condition)){ printf("    %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } }while(0)
+
+static byte buffer[8192]; 
+
+/**
+ * @brief Test data, different for every file and offset 
+ * 
+ */
+static byte pattern(uint32_t seed, uint32_t offset){
+    return (byte)((offset * 31 + (offset >> 8) + seed * 101) ^ (seed >> 3)); 
+}
+
+/**
+ * @brief Write length bytes of pattern(seed) to the open file, calling service() in between 
+ * 
+ */
+static bool write_pattern(FlashFAT &fs, FlashFAT_sim &sim, uint32_t seed, uint32_t length){
+    for(uint32_t offset = 0; offset < length; ){
+        uint chunk = length - offset < 1000 ? length - offset : 1000; 
+        for(uint i = 0; i < chunk; i ++) buffer[i] = pattern(seed, offset + i); 
+        if(fs.write(buffer, chunk) != FLASHFAT_OK) return false; 
+        fs.service(); 
+        sim.advance(500000); 
+        offset += chunk; 
+    }
+    return true; 
+}
+
+/**
+ * @brief Check a closed file holds length bytes of pattern(seed) 
+ * 
+ */
+static bool check_pattern(FlashFAT &fs, uint fi, uint32_t seed, uint32_t length){
+    FlashFAT_File file; 
+    if(fs.open_file(fi, &file) != FLASHFAT_OK || file.peek() != length) return false; 
+    for(uint32_t offset = 0; offset < length; ){
+        uint read = file.read(buffer, sizeof(buffer)); 
+        if(read == 0) return false; 
+        for(uint i = 0; i < read; i ++) if(buffer[i] != pattern(seed, offset + i)) return false; 
+        offset += read; 
+    }
+    return true; 
+}
+
+/**
+ * @brief Check the open file came back as a prefix of its pattern no shorter than at_least 
+ * 
+ */
+static bool check_prefix(FlashFAT &fs, uint fi, uint32_t seed, uint32_t at_least, uint32_t at_most, uint32_t *length){
+    FlashFAT_File file; 
+    if(fs.open_file(fi, &file) != FLASHFAT_OK) return false; 
+    *length = file.peek(); 
+    file.close(); 
+    if(*length < at_least || *length > at_most) return false; 
+    return check_pattern(fs, fi, seed, *length); 
+}
+
+/**
+ * @brief Call service() until the background work is done 
+ * 
+ */
+static void settle(FlashFAT &fs, FlashFAT_sim &sim){
+    for(int i = 0; i < 100000 && (fs.is_erasing() || fs.is_compacting() || sim.is_busy()); i ++){
+        fs.service(); 
+        sim.advance(1000000); 
+    }
+}
+
+/**
+ * @brief Simulated chip that loses power after a number of programs and erases 
+ * 
+ * Commands after the cut do nothing, reads still see the chip. Mount a new FlashFAT on the sim to power back up. 
+ * It can also tear the next journal record of one type: only its type byte is programmed and the program fails. 
+ */
+class power_cut_device : public FlashFAT_device{
+public: 
+    power_cut_device(FlashFAT_sim *sim, long budget) : _sim(sim), _budget(budget){}
+    uint32_t capacity(){ return _sim->capacity(); }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *page){ return _sim->read_page(address, page); }
+    FlashFAT_device_status_t read(uint32_t address, byte *page, uint32_t length){ return _sim->read(address, page, length); }
+    FlashFAT_device_status_t write_page(uint32_t address, byte *page){
+        if(!powered()) return FLASHFAT_DEVICE_OK; 
+        return tear(address, page) ? FLASHFAT_DEVICE_FAILURE : _sim->write_page(address, page); 
+    }
+    FlashFAT_device_status_t erase_sector(uint32_t address){ return powered() ? _sim->erase_sector(address) : FLASHFAT_DEVICE_OK; }
+    FlashFAT_device_status_t erase_block(uint32_t address){ return powered() ? _sim->erase_block(address) : FLASHFAT_DEVICE_OK; }
+    FlashFAT_device_status_t erase_half_block(uint32_t address){ return powered() ? _sim->erase_half_block(address) : FLASHFAT_DEVICE_OK; }
+    bool is_busy(){ return _sim->is_busy(); }
+    FlashFAT_device_status_t wait_until_free(){ return _sim->wait_until_free(); }
+    uint32_t time_ms(){ return _sim->time_ms(); }
+    bool cut(){ return _budget < 0; }
+    void tear_next(byte type){ _tear_record = type; }
+    bool torn(){ return _tear_record == 0; }
+
+private: 
+    FlashFAT_sim *_sim;     ///< Chip behind the power 
+    long _budget;           ///< Programs and erases left before the cut 
+    byte _tear_record = 0;  ///< Journal record type to tear, 0 for none or once torn 
+
+    bool powered(){ return -- _budget >= 0; }
+
+    bool tear(uint32_t address, byte *page){
+        if(_tear_record == 0 || address >= FLASH_FAT_DATA_START) return false; 
+        // the first byte this program adds starts the record 
+        const byte *old = _sim->data() + address; 
+        uint i = 0; 
+        while(i < FLASH_FAT_PAGE_SIZE && (old[i] != 0xFF || page[i] == 0xFF)) i ++; 
+        if(i == FLASH_FAT_PAGE_SIZE || page[i] != _tear_record) return false; 
+        byte partial[FLASH_FAT_PAGE_SIZE]; 
+        memset(partial, 0xFF, sizeof(partial)); 
+        memcpy(partial, page, i + 1); 
+        _sim->write_page(address, partial); 
+        _tear_record = 0; 
+        return true; 
+    }
+};
+
+/**
+ * @brief Simulated chip that reads but fails every program and erase 
+ * 
+ */
+class read_only_device : public FlashFAT_device{
+public: 
+    read_only_device(FlashFAT_sim *sim) : _sim(sim){}
+    uint32_t capacity(){ return _sim->capacity(); }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *page){ return _sim->read_page(address, page); }
+    FlashFAT_device_status_t read(uint32_t address, byte *page, uint32_t length){ return _sim->read(address, page, length); }
+    FlashFAT_device_status_t write_page(uint32_t, byte *){ return FLASHFAT_DEVICE_FAILURE; }
+    FlashFAT_device_status_t erase_sector(uint32_t){ return FLASHFAT_DEVICE_FAILURE; }
+    bool is_busy(){ return _sim->is_busy(); }
+    FlashFAT_device_status_t wait_until_free(){ return _sim->wait_until_free(); }
+
+private: 
+    FlashFAT_sim *_sim;     ///< Chip behind it 
+};
+
+/**
+ * @brief Simulated chip that stays busy in real time, for tests with threads 
+ * 
+ * The sim holds the data and finishes every command at once, the busy time runs on the steady clock. Only sector 
+ * erases, so erasing a reserve takes many of them. 
+ */
+class realtime_device : public FlashFAT_device{
+public: 
+    realtime_device(FlashFAT_sim *sim) : _sim(sim){ _sim->wait_until_free(); }
+    uint32_t capacity(){ return _sim->capacity(); }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *page){ return is_busy() ? FLASHFAT_DEVICE_BUSY : _sim->read_page(address, page); }
+    FlashFAT_device_status_t read(uint32_t address, byte *page, uint32_t length){ return is_busy() ? FLASHFAT_DEVICE_BUSY : _sim->read(address, page, length); }
+    FlashFAT_device_status_t write_page(uint32_t address, byte *page){ return is_busy() ? FLASHFAT_DEVICE_BUSY : start(_sim->write_page(address, page), 200); }
+    FlashFAT_device_status_t erase_sector(uint32_t address){ return is_busy() ? FLASHFAT_DEVICE_BUSY : start(_sim->erase_sector(address), 10000); }
+    bool is_busy(){ return std::chrono::steady_clock::now() < _busy_until; }
+    FlashFAT_device_status_t wait_until_free(){
+        std::this_thread::sleep_until(_busy_until); 
+        return FLASHFAT_DEVICE_OK; 
+    }
+
+private: 
+    FlashFAT_sim *_sim;                                     ///< Chip behind it 
+    std::chrono::steady_clock::time_point _busy_until;      ///< End of the current program or erase 
+
+    FlashFAT_device_status_t start(FlashFAT_device_status_t status, long time_us){
+        _sim->wait_until_free(); 
+        if(status == FLASHFAT_DEVICE_OK) _busy_until = std::chrono::steady_clock::now() + std::chrono::microseconds(time_us); 
+        return status; 
+    }
+};
+
+/**
+ * @brief Simulated chip that keeps count of the erases of every sector and of misaligned block erases 
+ * 
+ */
+class erase_log_device : public FlashFAT_device{
+public: 
+    erase_log_device(FlashFAT_sim *sim) : _sim(sim){ clear(); }
+    uint32_t capacity(){ return _sim->capacity(); }
+    FlashFAT_device_status_t read_page(uint32_t address, byte *page){ return _sim->read_page(address, page); }
+    FlashFAT_device_status_t read(uint32_t address, byte *page, uint32_t length){ return _sim->read(address, page, length); }
+    FlashFAT_device_status_t write_page(uint32_t address, byte *page){ return _sim->write_page(address, page); }
+    FlashFAT_device_status_t erase_sector(uint32_t address){ return log(_sim->erase_sector(address), address, 4096); }
+    FlashFAT_device_status_t erase_block(uint32_t address){ return log(_sim->erase_block(address), address, FLASH_FAT_BLOCK_SIZE); }
+    FlashFAT_device_status_t erase_half_block(uint32_t address){ return log(_sim->erase_half_block(address), address, FLASH_FAT_HALF_BLOCK_SIZE); }
+    bool is_busy(){ return _sim->is_busy(); }
+    FlashFAT_device_status_t wait_until_free(){ return _sim->wait_until_free(); }
+    uint32_t time_ms(){ return _sim->time_ms(); }
+    void clear(){
+        memset(erases, 0, sizeof(erases)); 
+        misaligned = 0; 
+    }
+
+    uint8_t erases[256];        ///< Erases of each sector of the first 1MB 
+    uint32_t misaligned;        ///< Erases not on a boundary of their own size 
+
+private: 
+    FlashFAT_sim *_sim;         ///< Chip behind it 
+
+    FlashFAT_device_status_t log(FlashFAT_device_status_t status, uint32_t address, uint32_t size){
+        if(status != FLASHFAT_DEVICE_OK) return status; 
+        if(address % size != 0) misaligned ++; 
+        for(uint32_t sector = address >> 12; sector < (address + size) >> 12 && sector < 256; sector ++) erases[sector] ++; 
+        return status; 
+    }
+};
+
+/**
+ * @brief What the chip should hold, pattern seed and length of every file in index order 
+ * 
+ */
+typedef struct{
+    uint count;                 ///< Files 
+    uint32_t seed[32];          ///< pattern() seed of each file 
+    uint32_t length[32];        ///< Length of each file 
+}   file_model; 
+
+static void model_add(file_model *model, uint32_t seed, uint32_t length){
+    model->seed[model->count] = seed; 
+    model->length[model->count] = length; 
+    model->count ++; 
+}
+
+/**
+ * @brief Remove a file from the model, later files move down an index like delete_file() 
+ * 
+ */
+static void model_delete(file_model *model, uint fi){
+    for(uint i = fi; i + 1 < model->count; i ++){
+        model->seed[i] = model->seed[i + 1]; 
+        model->length[i] = model->length[i + 1]; 
+    }
+    model->count --; 
+}
+
+/**
+ * @brief Check the chip holds exactly the files of the model 
+ * 
+ */
+static bool check_model(FlashFAT &fs, const file_model *model){
+    FlashFAT_file_allocation_table table; 
+    if(fs.get_file_allocation_table(&table) != FLASHFAT_OK || table._num_files != model->count) return false; 
+    for(uint i = 0; i < model->count; i ++) if(!check_pattern(fs, i, model->seed[i], model->length[i])) return false; 
+    return true; 
+}
+
+/**
+ * @brief Repeatable random numbers for the model tests 
+ * 
+ */
+static uint32_t next_random(uint32_t *state){
+    *state = *state * 1103515245UL + 12345; 
+    return (*state >> 16) & 0x7FFF; 
+}
+
+/**
+ * @brief A file started in the space the last file erased ahead must not leave erased bits behind 
+ * 
+ * The background erase marks the spare sectors erased again. The next file programs them without going through 
+ * erase_next_sector(), once it is deleted the stale bits would skip the erase its sectors need. 
+ */
+static bool test_spare_range_erased_map(){
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    FlashFAT_sim sim(config); 
+    {
+        FlashFAT fs; 
+        fs.set_background_erase(true); 
+        fs.set_erase_ahead(2); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 1, 5000)); 
+        // let the erase ahead get past the file's last sector, the next file starts in what it erased 
+        for(int i = 0; i < 100; i ++){
+            fs.service(); 
+            sim.advance(1000000); 
+        }
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // every free sector comes back erased and saved in the journal 
+        CHECK(fs.delete_all_files() == FLASHFAT_OK); 
+        settle(fs, sim); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 2, 9000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 3, 3000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // saves the erased map again 
+        CHECK(fs.delete_file(1) == FLASHFAT_OK); 
+        settle(fs, sim); 
+    }
+    FlashFAT fs; 
+    fs.set_background_erase(true); 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    // go round the chip a few times so the stale sectors are written again 
+    for(uint32_t seed = 4; seed < 40; seed ++){
+        FlashFAT_file_allocation_table table; 
+        CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        if(table._num_files >= 3){
+            CHECK(fs.delete_file(0) == FLASHFAT_OK); 
+            settle(fs, sim); 
+        }
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, seed, 20000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        CHECK(check_pattern(fs, table._num_files - 1, seed, 20000)); 
+    }
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Files of a version 1 chip 
+ * 
+ */
+static const uint32_t legacy_start[] = {4096, 8192, 20480}; 
+static const uint32_t legacy_length[] = {3000, 5000, 10000}; 
+
+/**
+ * @brief Write a version 1 table and its files straight into the chip 
+ * 
+ */
+static void make_legacy_chip(FlashFAT_sim &sim, uint32_t last_length){
+    byte *data = sim.data(); 
+    memset(data, 0xFF, sim.capacity()); 
+    memset(data, 0, 256); 
+    memcpy(data, "FLASHFAT", 8); 
+    data[8] = 3; 
+    data[9] = 255; 
+    for(uint i = 0; i < 3; i ++){
+        uint32_t length = i == 2 ? last_length : legacy_length[i]; 
+        byte *entry = &data[10 + i * 5]; 
+        entry[0] = (legacy_start[i] >> 8) >> 8; 
+        entry[1] = legacy_start[i] >> 8; 
+        entry[2] = (length >> 8) >> 8; 
+        entry[3] = length >> 8; 
+        entry[4] = length & 255; 
+        for(uint32_t offset = 0; offset < length; offset ++) data[legacy_start[i] + offset] = pattern(100 + i, offset); 
+    }
+}
+
+/**
+ * @brief Check the three version 1 files made it across 
+ * 
+ */
+static bool check_legacy_files(FlashFAT &fs){
+    FlashFAT_file_allocation_table table; 
+    if(fs.get_file_allocation_table(&table) != FLASHFAT_OK || table._num_files < 3) return false; 
+    for(uint i = 0; i < 3; i ++) if(!check_pattern(fs, i, 100 + i, legacy_length[i])) return false; 
+    return true; 
+}
+
+/**
+ * @brief A version 1 chip keeps every file and is migrated once 
+ * 
+ */
+static bool test_legacy_migration(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    make_legacy_chip(sim, legacy_length[2]); 
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(check_legacy_files(fs)); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 7, 6000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    for(int mount = 0; mount < 2; mount ++){
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        FlashFAT_file_allocation_table table; 
+        CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        CHECK(table._num_files == 4); 
+        CHECK(check_legacy_files(fs)); 
+        CHECK(check_pattern(fs, 3, 7, 6000)); 
+    }
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Power lost anywhere in the migration keeps every file 
+ * 
+ */
+static bool test_legacy_migration_power_cut(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    for(long budget = 0; ; budget ++){
+        make_legacy_chip(sim, legacy_length[2]); 
+        power_cut_device device(&sim, budget); 
+        {
+            FlashFAT fs; 
+            fs.begin(&device); 
+        }
+        sim.wait_until_free(); 
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(check_legacy_files(fs)); 
+        if(!device.cut()) break; 
+    }
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Without room to move the version 1 files the chip is left alone 
+ * 
+ */
+static bool test_legacy_no_space(){
+    FlashFAT_sim_config config; 
+    config.capacity = 64 << 10; 
+    FlashFAT_sim sim(config); 
+    make_legacy_chip(sim, 40000); 
+    byte *before = new byte[config.capacity]; 
+    memcpy(before, sim.data(), config.capacity); 
+    FlashFAT fs; 
+    bool refused = fs.begin(&sim) == FLASHFAT_LEGACY_NO_SPACE; 
+    bool untouched = memcmp(before, sim.data(), config.capacity) == 0; 
+    delete[] before; 
+    CHECK(refused); 
+    CHECK(untouched); 
+    CHECK(fs.new_file() == FLASHFAT_LEGACY_NO_SPACE); 
+    return true; 
+}
+
+/**
+ * @brief A device past what FLASH_FAT_MAX_SECTORS covers mounts, says so, and stays below the limit 
+ * 
+ */
+static bool test_capacity_clamped(){
+    FlashFAT_sim_config config; 
+    config.capacity = 32UL << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_CAPACITY_CLAMPED); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 7, 10000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_CAPACITY_CLAMPED); 
+    CHECK(check_pattern(fs, 0, 7, 10000)); 
+    uint32_t limit = FLASH_FAT_MAX_SECTORS * 4096UL; 
+    for(uint32_t address = limit; address < config.capacity; address ++) CHECK(sim.data()[address] == 0xFF); 
+    return true; 
+}
+
+/**
+ * @brief A blank chip whose table can't be written doesn't mount 
+ * 
+ */
+static bool test_begin_table_write_failure(){
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    FlashFAT_sim sim(config); 
+    read_only_device device(&sim); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&device) == FLASHFAT_FLASH_FAILURE); 
+    // nothing made it onto the chip, the next mount creates the table 
+    FlashFAT remount; 
+    CHECK(remount.begin(&sim) == FLASHFAT_OK); 
+    return true; 
+}
+
+/**
+ * @brief A file left open that can't be journaled closed fails the mount, and is recovered by the next one 
+ * 
+ */
+static bool test_begin_recovery_failure(){
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    FlashFAT_sim sim(config); 
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 8, 5000)); 
+        CHECK(fs.service() == FLASHFAT_OK); 
+        // power lost with the file open 
+    }
+    sim.wait_until_free(); 
+    read_only_device device(&sim); 
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&device) == FLASHFAT_FLASH_FAILURE); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._num_files == 1 && table._file_close_err == FLASH_FAT_NO_ERROR_FILE); 
+    uint32_t length; 
+    CHECK(check_prefix(fs, 0, 8, 5000 - FLASH_FAT_FILE_BUFFER * FLASH_FAT_WRITE_BUFFER_COUNT, 5000, &length)); 
+    return true; 
+}
+
+/**
+ * @brief A progress record that fails to append doesn't take the file's close record down with it 
+ * 
+ * The close would otherwise follow the torn record on the same journal page, and mount skips the rest of a page 
+ * after a torn record. 
+ */
+static bool test_torn_progress_record(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        power_cut_device device(&sim, 1L << 30); 
+        FlashFAT fs; 
+        fs.set_checkpoint(4096, 0); 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        // 0x08 is a PROGRESS record 
+        device.tear_next(0x08); 
+        // the write that tears it reports the failure, tell() has what it took 
+        for(uint32_t offset = 0; offset < 20000; offset = fs.tell()){
+            uint chunk = 20000 - offset < 1000 ? 20000 - offset : 1000; 
+            for(uint i = 0; i < chunk; i ++) buffer[i] = pattern(81, offset + i); 
+            FlashFAT_status_t status = fs.write(buffer, chunk); 
+            CHECK(status == FLASHFAT_OK || (status == FLASHFAT_FLASH_FAILURE && device.torn())); 
+            fs.service(); 
+            sim.advance(500000); 
+        }
+        CHECK(device.torn()); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 81, 20000)); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._file_close_err == FLASH_FAT_NO_ERROR_FILE); 
+    return true; 
+}
+
+/**
+ * @brief A wear record that fails to append doesn't take the next file down with it 
+ * 
+ * delete_all_files() saves the counters right after the count. 
+ */
+static bool test_torn_wear_record(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        power_cut_device device(&sim, 1L << 30); 
+        FlashFAT fs; 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 82, 5000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // 0x06 is a WEAR record 
+        device.tear_next(0x06); 
+        CHECK(fs.delete_all_files() == FLASHFAT_FLASH_FAILURE); 
+        CHECK(device.torn()); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 83, 5000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._num_files == 1 && table._file_close_err == FLASH_FAT_NO_ERROR_FILE); 
+    CHECK(check_pattern(fs, 0, 83, 5000)); 
+    return true; 
+}
+
+/**
+ * @brief An erased map record that fails to append doesn't take the next file down with it 
+ * 
+ * The background erase saves the map once it has erased what a delete freed. 
+ */
+static bool test_torn_erased_record(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        power_cut_device device(&sim, 1L << 30); 
+        FlashFAT fs; 
+        fs.set_background_erase(true); 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 84, 5000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        settle(fs, sim); 
+        CHECK(fs.delete_file(0) == FLASHFAT_OK); 
+        // 0x07 is an ERASED record 
+        device.tear_next(0x07); 
+        settle(fs, sim); 
+        CHECK(device.torn()); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 85, 5000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._num_files == 1 && table._file_close_err == FLASH_FAT_NO_ERROR_FILE); 
+    CHECK(check_pattern(fs, 0, 85, 5000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief close_file() reports a file record that didn't make it to the journal 
+ * 
+ * The file is closed anyway and the next change rewrites the table with it. 
+ */
+static bool test_close_record_failure(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        power_cut_device device(&sim, 1L << 30); 
+        FlashFAT fs; 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 86, 5000)); 
+        // 0x03 is a FILE record 
+        device.tear_next(0x03); 
+        CHECK(fs.close_file() == FLASHFAT_FLASH_FAILURE); 
+        CHECK(device.torn()); 
+        CHECK(fs.tell() == 0); 
+        // same through a handle, which ends up closed 
+        FlashFAT_File writer; 
+        CHECK(fs.new_file(&writer) == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 87, 3000)); 
+        device.tear_next(0x03); 
+        CHECK(writer.close() == FLASHFAT_FLASH_FAILURE); 
+        CHECK(!writer.is_open()); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 88, 1000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 86, 5000)); 
+    CHECK(check_pattern(fs, 1, 87, 3000)); 
+    CHECK(check_pattern(fs, 2, 88, 1000)); 
+    return true; 
+}
+
+/**
+ * @brief A checkpoint by bytes or by time saves the bytes still in the write buffer across a power cut 
+ * 
+ * Without one only the full buffer programmed by service() comes back. 
+ */
+static bool test_checkpoint_policy(){
+    for(int policy = 0; policy < 3; policy ++){
+        FlashFAT_sim_config config; 
+        config.capacity = 1 << 20; 
+        FlashFAT_sim sim(config); 
+        {
+            FlashFAT fs; 
+            if(policy == 1) fs.set_checkpoint(600, 0); 
+            if(policy == 2) fs.set_checkpoint(0, 50); 
+            CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+            CHECK(fs.new_file() == FLASHFAT_OK); 
+            for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(91, i); 
+            CHECK(fs.write(buffer, 1000) == FLASHFAT_OK); 
+            for(int i = 0; i < 100; i ++){
+                CHECK(fs.service() == FLASHFAT_OK); 
+                sim.advance(1000000); 
+            }
+            // power goes without close_file() 
+        }
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        uint32_t length; 
+        CHECK(check_prefix(fs, 0, 91, policy ? 1000 : 0, policy ? 1000 : 999, &length)); 
+        CHECK(sim.stats().program_conflicts == 0); 
+    }
+    return true; 
+}
+
+/**
+ * @brief read() outside READ_MODE reads nothing instead of passing a status off as a byte count 
+ * 
+ */
+static bool test_read_wrong_mode(){
+    FlashFAT_sim_config config; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    byte page[16]; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.read(page, sizeof(page)) == 0); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 3, 100)); 
+    CHECK(fs.read(page, sizeof(page)) == 0); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    return true; 
+}
+
+/**
+ * @brief seek() takes any offset up to the length, pread() leaves tell() alone and reads past a chunk in pieces 
+ * 
+ */
+static bool test_seek_pread(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    const uint32_t length = 20000; 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 41, length)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    byte data[16]; 
+    // the file opened on the FlashFAT itself 
+    CHECK(fs.open_file(0) == FLASHFAT_OK); 
+    CHECK(fs.seek(length / 2) == FLASHFAT_OK); 
+    CHECK(fs.tell() == length / 2 && fs.peek() == length / 2); 
+    CHECK(fs.read(data, sizeof(data)) == sizeof(data)); 
+    for(uint i = 0; i < sizeof(data); i ++) CHECK(data[i] == pattern(41, length / 2 + i)); 
+    CHECK(fs.pread(100, data, sizeof(data)) == sizeof(data)); 
+    for(uint i = 0; i < sizeof(data); i ++) CHECK(data[i] == pattern(41, 100 + i)); 
+    CHECK(fs.tell() == length / 2 + sizeof(data)); 
+    CHECK(fs.seek(0) == FLASHFAT_OK); 
+    CHECK(fs.tell() == 0 && fs.peek() == length); 
+    CHECK(fs.seek(length) == FLASHFAT_OK); 
+    CHECK(fs.peek() == 0 && fs.read(data, sizeof(data)) == 0); 
+    CHECK(fs.seek(length + 1) == FLASHFAT_INVALID_OFFSET); 
+    CHECK(fs.tell() == length); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(fs.seek(0) == FLASHFAT_WRONG_MODE); 
+    // and on a handle 
+    FlashFAT_File file; 
+    CHECK(fs.open_file(0, &file) == FLASHFAT_OK); 
+    CHECK(file.seek(length / 2) == FLASHFAT_OK); 
+    CHECK(file.tell() == length / 2 && file.peek() == length / 2); 
+    CHECK(file.seek(0) == FLASHFAT_OK && file.tell() == 0); 
+    CHECK(file.seek(length) == FLASHFAT_OK && file.peek() == 0); 
+    CHECK(file.read(data, sizeof(data)) == 0); 
+    CHECK(file.seek(length + 1) == FLASHFAT_INVALID_OFFSET); 
+    CHECK(file.tell() == length); 
+    CHECK(file.pread(length - 10, data, sizeof(data)) == 10); 
+    CHECK(file.pread(length, data, sizeof(data)) == 0); 
+    // one read command per FLASH_FAT_READ_CHUNK, the pieces land back to back 
+    const uint32_t offset = 1000; 
+    const uint span = FLASH_FAT_READ_CHUNK + 1000; 
+    uint32_t commands = sim.stats().read_commands; 
+    CHECK(file.pread(offset, buffer, span) == span); 
+    CHECK(sim.stats().read_commands - commands == 2); 
+    for(uint i = 0; i < span; i ++) CHECK(buffer[i] == pattern(41, offset + i)); 
+    CHECK(file.tell() == length); 
+    return true; 
+}
+
+/**
+ * @brief read() streams any offset and length with one read command per FLASH_FAT_READ_CHUNK 
+ * 
+ * The chip sends exactly the bytes asked for, no page around them. 
+ */
+static bool test_continuous_read(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    const uint32_t length = 30000; 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 61, length)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(fs.open_file(0) == FLASHFAT_OK); 
+    const uint sizes[] = {1, 255, 3000, FLASH_FAT_READ_CHUNK + 1, 7, sizeof(buffer)}; 
+    const uint count = sizeof(sizes) / sizeof(sizes[0]); 
+    uint32_t offset = 0; 
+    for(uint i = 0; offset < length; i ++){
+        uint size = sizes[i < count ? i : count - 1]; 
+        FlashFAT_sim_stats before = sim.stats(); 
+        uint read = fs.read(buffer, size); 
+        CHECK(read == (size < length - offset ? size : length - offset)); 
+        CHECK(sim.stats().read_commands - before.read_commands == (read + FLASH_FAT_READ_CHUNK - 1) / FLASH_FAT_READ_CHUNK); 
+        CHECK(sim.stats().read_bytes - before.read_bytes == read); 
+        for(uint j = 0; j < read; j ++) CHECK(buffer[j] == pattern(61, offset + j)); 
+        offset += read; 
+    }
+    CHECK(fs.read(buffer, 1) == 0); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    return true; 
+}
+
+/**
+ * @brief Read handles keep their own positions, next to each other and next to a write handle 
+ * 
+ */
+static bool test_handles_side_by_side(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 21, 10000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    // two readers on the same file, interleaved 
+    FlashFAT_File first; 
+    FlashFAT_File second; 
+    CHECK(fs.open_file(0, &first) == FLASHFAT_OK); 
+    CHECK(fs.open_file(0, &second) == FLASHFAT_OK); 
+    byte data[300]; 
+    CHECK(first.read(data, 100) == 100); 
+    CHECK(second.read(data, 300) == 300); 
+    for(uint i = 0; i < 300; i ++) CHECK(data[i] == pattern(21, i)); 
+    CHECK(first.read(data, 300) == 300); 
+    for(uint i = 0; i < 300; i ++) CHECK(data[i] == pattern(21, 100 + i)); 
+    CHECK(first.tell() == 400 && second.tell() == 300); 
+    CHECK(first.peek() == 9600 && second.peek() == 9700); 
+    CHECK(second.close() == FLASHFAT_OK); 
+    CHECK(!second.is_open() && first.is_open()); 
+    CHECK(second.read(data, 10) == 0); 
+    // a writer alongside the reader 
+    FlashFAT_File writer; 
+    CHECK(fs.new_file(&writer) == FLASHFAT_OK); 
+    CHECK(writer.read(data, 10) == 0); 
+    for(uint32_t offset = 0; offset < 8000; offset += 1000){
+        for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(22, offset + i); 
+        CHECK(writer.write(buffer, 1000) == FLASHFAT_OK); 
+        CHECK(writer.tell() == offset + 1000); 
+        fs.service(); 
+        sim.advance(500000); 
+        // the reader carries on through the old file 
+        CHECK(first.read(data, 300) == 300); 
+        for(uint i = 0; i < 300; i ++) CHECK(data[i] == pattern(21, first.tell() - 300 + i)); 
+    }
+    CHECK(first.write(data, 10) == FLASHFAT_WRONG_MODE); 
+    CHECK(writer.close() == FLASHFAT_OK); 
+    CHECK(!writer.is_open()); 
+    CHECK(writer.write(data, 10) == FLASHFAT_WRONG_MODE); 
+    // opened before the new file, still reads the old one to its end 
+    CHECK(first.peek() == 10000 - first.tell()); 
+    CHECK(first.close() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 21, 10000)); 
+    CHECK(check_pattern(fs, 1, 22, 8000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Handles never outlive what they point at 
+ * 
+ * Calls that would move the table under a read handle are refused, and closing the file directly closes its 
+ * write handle so it can't write into the next file. 
+ */
+static bool test_handles_not_left_stale(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 23, 3000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    {
+        FlashFAT_File reader; 
+        CHECK(fs.open_file(0, &reader) == FLASHFAT_OK); 
+        CHECK(fs.invalidate_file_allocation_table() == FLASHFAT_WRONG_MODE); 
+        CHECK(fs.create_file_allocation_table() == FLASHFAT_WRONG_MODE); 
+        CHECK(reader.peek() == 3000); 
+    }
+    CHECK(fs.invalidate_file_allocation_table() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 23, 3000)); 
+    // closed under the write handle 
+    FlashFAT_File writer; 
+    CHECK(fs.new_file(&writer) == FLASHFAT_OK); 
+    CHECK(fs.create_file_allocation_table() == FLASHFAT_WRONG_MODE); 
+    for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(24, i); 
+    CHECK(writer.write(buffer, 1000) == FLASHFAT_OK); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(!writer.is_open()); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(writer.write(buffer, 1000) == FLASHFAT_WRONG_MODE); 
+    CHECK(writer.close() == FLASHFAT_OK); 
+    // the next file is still open 
+    CHECK(write_pattern(fs, sim, 25, 2000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    // a write handle destroyed with its file open leaves the file to close_file() 
+    {
+        FlashFAT_File gone; 
+        CHECK(fs.new_file(&gone) == FLASHFAT_OK); 
+        for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(24, i); 
+        CHECK(gone.write(buffer, 1000) == FLASHFAT_OK); 
+    }
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 1, 24, 1000)); 
+    CHECK(check_pattern(fs, 2, 25, 2000)); 
+    CHECK(check_pattern(fs, 3, 24, 1000)); 
+    CHECK(fs.create_file_allocation_table() == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK && table._num_files == 0); 
+    return true; 
+}
+
+/**
+ * @brief Open read handles hold off deletes and compaction, closing or destroying them lets both through 
+ * 
+ */
+static bool test_handles_block_delete_and_compaction(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    for(uint32_t seed = 31; seed < 34; seed ++){
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, seed, 20000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    {
+        FlashFAT_File file; 
+        CHECK(fs.open_file(0, &file) == FLASHFAT_OK); 
+        CHECK(fs.delete_file(0) == FLASHFAT_WRONG_MODE); 
+        CHECK(fs.delete_last_file() == FLASHFAT_WRONG_MODE); 
+        CHECK(fs.delete_all_files() == FLASHFAT_WRONG_MODE); 
+    }
+    // the destructor closed it 
+    CHECK(fs.delete_file(0) == FLASHFAT_OK); 
+    settle(fs, sim); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    uint32_t start = table._files[1]._start_page; 
+    // the last file fits the hole the first left, but not while a handle reads it 
+    FlashFAT_File file; 
+    CHECK(fs.open_file(1, &file) == FLASHFAT_OK); 
+    CHECK(fs.compact() == FLASHFAT_OK); 
+    for(int i = 0; i < 500; i ++){
+        CHECK(fs.service() == FLASHFAT_OK); 
+        sim.advance(50000000); 
+    }
+    CHECK(fs.is_compacting()); 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._files[1]._start_page == start); 
+    CHECK(file.read(buffer, sizeof(buffer)) == sizeof(buffer)); 
+    for(uint i = 0; i < sizeof(buffer); i ++) CHECK(buffer[i] == pattern(33, i)); 
+    CHECK(file.close() == FLASHFAT_OK); 
+    settle(fs, sim); 
+    CHECK(!fs.is_compacting()); 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._files[1]._start_page < start); 
+    CHECK(check_pattern(fs, 0, 32, 20000)); 
+    CHECK(check_pattern(fs, 1, 33, 20000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Find where the next record of the newest journal area goes 
+ * 
+ * @param sequence  Filled with the sequence number of the area 
+ * @return uint32_t Bytes left in the area 
+ */
+static uint32_t journal_room(FlashFAT_sim &sim, uint32_t *sequence){
+    const uint32_t area_size = FLASH_FAT_JOURNAL_SECTORS * 4096UL; 
+    byte *data = sim.data(); 
+    uint32_t base = 0; 
+    *sequence = 0; 
+    for(uint32_t area = 0; area < FLASH_FAT_JOURNAL_AREAS; area ++){
+        byte *header = &data[area * area_size]; 
+        if(header[0] != 0x01 || memcmp(&header[3], "FLASHFAT", 8) != 0) continue; 
+        uint32_t area_sequence = (uint32_t)header[12] << 24 | (uint32_t)header[13] << 16 | header[14] << 8 | header[15]; 
+        if(area_sequence >= *sequence){
+            *sequence = area_sequence; 
+            base = area * area_size; 
+        }
+    }
+    // type, payload length, payload and CRC after the header 
+    uint32_t index = base + 18; 
+    while(index < base + area_size && data[index] != 0xFF) index += 5 + (data[index + 1] << 8 | data[index + 2]); 
+    return base + area_size - index; 
+}
+
+/**
+ * @brief service() waits at most a page program, even with a full journal and an unerased standby area 
+ * 
+ * Records are appended without calling service() until a rollover has left the old area as the standby and the 
+ * new area has no room for the open file's first progress record. 
+ */
+static bool test_service_never_blocks(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    uint32_t first_sequence, sequence; 
+    journal_room(sim, &first_sequence); 
+    // a count record is 9 bytes, the new file's record 20 and the progress record 15 
+    while(true){
+        uint32_t room = journal_room(sim, &sequence); 
+        if(sequence > first_sequence && room >= 20 && room < 35) break; 
+        CHECK(fs.delete_last_file() == FLASHFAT_OK); 
+    }
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    const uint32_t length = 20000; 
+    uint64_t longest = 0; 
+    for(uint32_t offset = 0; offset < length; offset += 1000){
+        for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(11, offset + i); 
+        CHECK(fs.write(buffer, 1000) == FLASHFAT_OK); 
+        for(int i = 0; i < 20; i ++){
+            sim.advance(5000000); 
+            uint64_t waited = sim.stats().busy_wait_ns; 
+            CHECK(fs.service() == FLASHFAT_OK); 
+            if(sim.stats().busy_wait_ns - waited > longest) longest = sim.stats().busy_wait_ns - waited; 
+        }
+    }
+    CHECK(journal_room(sim, &sequence) > 35 && sequence == first_sequence + 2); 
+    CHECK(longest <= config.page_program_us * 1000ULL); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 11, length)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief With idle time between writes the erase ahead keeps sector erases out of write() 
+ * 
+ * Every write is a sector long and crosses into the next one. Without erase ahead each write erases that sector 
+ * and waits it out. 
+ */
+static bool test_erase_ahead_idle(){
+    for(uint ahead = 0; ahead < 3; ahead ++){
+        FlashFAT_sim_config config; 
+        config.capacity = 1 << 20; 
+        FlashFAT_sim sim(config); 
+        FlashFAT fs; 
+        fs.set_erase_ahead(ahead); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        const uint32_t length = 10 * 4096 + 2048; 
+        uint32_t erases = 0; 
+        uint64_t longest = 0; 
+        for(uint i = 0; i < 2048; i ++) buffer[i] = pattern(15, i); 
+        CHECK(fs.write(buffer, 2048) == FLASHFAT_OK); 
+        // the standby journal area gets its erases first 
+        for(int i = 0; i < 1000; i ++){
+            CHECK(fs.service() == FLASHFAT_OK); 
+            sim.advance(1000000); 
+        }
+        for(uint32_t offset = 2048; offset < length; offset += 4096){
+            // 100ms of idle time, enough for a sector erase 
+            for(int i = 0; i < 100; i ++){
+                CHECK(fs.service() == FLASHFAT_OK); 
+                sim.advance(1000000); 
+            }
+            for(uint i = 0; i < 4096; i ++) buffer[i] = pattern(15, offset + i); 
+            FlashFAT_sim_stats before = sim.stats(); 
+            CHECK(fs.write(buffer, 4096) == FLASHFAT_OK); 
+            erases += sim.stats().sector_erases - before.sector_erases; 
+            if(sim.stats().busy_wait_ns - before.busy_wait_ns > longest) longest = sim.stats().busy_wait_ns - before.busy_wait_ns; 
+        }
+        if(ahead == 0) CHECK(erases > 0 && longest > config.sector_erase_us * 1000ULL); 
+        else CHECK(erases == 0 && longest < config.sector_erase_us * 1000ULL); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        CHECK(check_pattern(fs, 0, 15, length)); 
+        CHECK(sim.stats().program_conflicts == 0); 
+    }
+    return true; 
+}
+
+/**
+ * @brief Check free_bytes(), used_bytes() and largest_contiguous_free() against the table and each other 
+ * 
+ */
+static bool check_space(FlashFAT &fs, FlashFAT_sim &sim){
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    static bool used[1024]; 
+    uint32_t sectors = sim.capacity() / 4096; 
+    memset(used, 0, sizeof(used)); 
+    uint32_t used_bytes = 0; 
+    for(uint i = 0; i < table._num_files; i ++){
+        uint32_t start = table._files[i]._start_page * 256; 
+        uint32_t end = start + table._files[i]._page_length * 256 + table._files[i]._end_offset; 
+        used_bytes += end - start; 
+        for(uint32_t sector = start >> 12; sector < (end + 4095) >> 12; sector ++) used[sector] = true; 
+    }
+    uint32_t free = 0; 
+    uint32_t largest = 0; 
+    uint32_t run = 0; 
+    for(uint32_t sector = FLASH_FAT_DATA_START / 4096; sector < sectors; sector ++){
+        run = used[sector] ? 0 : run + 1; 
+        if(!used[sector]) free ++; 
+        if(run > largest) largest = run; 
+    }
+    CHECK(fs.free_bytes() == free * 4096); 
+    CHECK(fs.used_bytes() == used_bytes); 
+    CHECK(fs.largest_contiguous_free() == largest * 4096); 
+    // the three agree, whole sectors are used or free 
+    CHECK(fs.largest_contiguous_free() <= fs.free_bytes()); 
+    CHECK(fs.used_bytes() <= sim.capacity() - FLASH_FAT_DATA_START - fs.free_bytes()); 
+    CHECK(fs.used_bytes() + 4096 * table._num_files >= sim.capacity() - FLASH_FAT_DATA_START - fs.free_bytes()); 
+    return true; 
+}
+
+/**
+ * @brief Space accounting stays right when deletes leave holes between files, and across a remount 
+ * 
+ */
+static bool test_space_after_holes(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(check_space(fs, sim)); 
+        CHECK(fs.largest_contiguous_free() == config.capacity - FLASH_FAT_DATA_START); 
+        for(uint32_t seed = 0; seed < 8; seed ++){
+            CHECK(fs.new_file() == FLASHFAT_OK); 
+            CHECK(write_pattern(fs, sim, seed, 5000 + seed * 3000)); 
+            CHECK(fs.close_file() == FLASHFAT_OK); 
+        }
+        CHECK(check_space(fs, sim)); 
+        uint32_t before = fs.free_bytes(); 
+        uint32_t largest = fs.largest_contiguous_free(); 
+        // a lone hole, then two neighbours making one bigger hole 
+        CHECK(fs.delete_file(1) == FLASHFAT_OK); 
+        CHECK(check_space(fs, sim)); 
+        CHECK(fs.free_bytes() > before); 
+        CHECK(fs.largest_contiguous_free() == largest); 
+        CHECK(fs.delete_file(2) == FLASHFAT_OK); 
+        CHECK(fs.delete_file(2) == FLASHFAT_OK); 
+        CHECK(check_space(fs, sim)); 
+        CHECK(fs.used_bytes() == 5000 + 11000 + 20000 + 23000 + 26000); 
+        // writing into the largest run, the open file counts up to what was written 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        uint32_t free = fs.free_bytes(); 
+        uint32_t used = fs.used_bytes(); 
+        CHECK(write_pattern(fs, sim, 8, 10000)); 
+        CHECK(fs.used_bytes() == used + 10000); 
+        CHECK(fs.free_bytes() == free - 3 * 4096); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        CHECK(check_space(fs, sim)); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(check_space(fs, sim)); 
+    CHECK(fs.used_bytes() == 5000 + 11000 + 20000 + 23000 + 26000 + 10000); 
+    return true; 
+}
+
+/**
+ * @brief Opens come out of the cached table, writes and deletes keep it current, invalidating rereads the chip 
+ * 
+ */
+static bool test_table_cache(){
+    FlashFAT_sim_config config; 
+    config.capacity = 512 << 10; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    for(uint32_t seed = 61; seed < 63; seed ++){
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, seed, 3000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    // no flash reads to open 
+    uint32_t commands = sim.stats().read_commands; 
+    FlashFAT_File file; 
+    for(uint fi = 0; fi < 2; fi ++){
+        CHECK(fs.open_file(fi, &file) == FLASHFAT_OK); 
+        CHECK(file.peek() == 3000); 
+    }
+    CHECK(file.close() == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK && table._num_files == 2); 
+    CHECK(sim.stats().read_commands == commands); 
+    // a new file is in the cache as soon as it is closed 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 63, 7000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    commands = sim.stats().read_commands; 
+    CHECK(fs.open_file(2, &file) == FLASHFAT_OK && file.peek() == 7000); 
+    CHECK(file.close() == FLASHFAT_OK); 
+    CHECK(sim.stats().read_commands == commands); 
+    CHECK(check_pattern(fs, 2, 63, 7000)); 
+    // and a deleted one gone 
+    CHECK(fs.delete_file(0) == FLASHFAT_OK); 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK && table._num_files == 2); 
+    CHECK(fs.open_file(2, &file) == FLASHFAT_INVALID_FILE); 
+    CHECK(check_pattern(fs, 0, 62, 3000)); 
+    CHECK(check_pattern(fs, 1, 63, 7000)); 
+    // another mount changes the chip, only seen after invalidating 
+    {
+        FlashFAT other; 
+        CHECK(other.begin(&sim) == FLASHFAT_OK); 
+        CHECK(other.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(other, sim, 64, 5000)); 
+        CHECK(other.close_file() == FLASHFAT_OK); 
+        settle(other, sim); 
+    }
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK && table._num_files == 2); 
+    CHECK(fs.invalidate_file_allocation_table() == FLASHFAT_OK); 
+    commands = sim.stats().read_commands; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK && table._num_files == 3); 
+    CHECK(sim.stats().read_commands > commands); 
+    CHECK(check_pattern(fs, 2, 64, 5000)); 
+    // files written from here land clear of the other mount's 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 65, 5000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 62, 3000)); 
+    CHECK(check_pattern(fs, 1, 63, 7000)); 
+    CHECK(check_pattern(fs, 2, 64, 5000)); 
+    CHECK(check_pattern(fs, 3, 65, 5000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Every erase the sim has done, of any size 
+ * 
+ */
+static uint32_t erase_count(FlashFAT_sim &sim){
+    return sim.stats().sector_erases + sim.stats().half_block_erases + sim.stats().block_erases; 
+}
+
+/**
+ * @brief new_file() with a reserve erases it up front or refuses when no run of free sectors holds it 
+ * 
+ */
+static bool test_new_file_reserve(){
+    FlashFAT_sim_config config; 
+    config.capacity = 512 << 10; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    const uint32_t data_size = config.capacity - FLASH_FAT_DATA_START; 
+    CHECK(fs.new_file(data_size + 1) == FLASHFAT_OUT_OF_SPACE); 
+    // holes that add up to more than the largest run 
+    for(uint32_t seed = 0; seed < 6; seed ++){
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, seed, 60000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+    }
+    CHECK(fs.delete_file(1) == FLASHFAT_OK); 
+    CHECK(fs.delete_file(2) == FLASHFAT_OK); 
+    uint32_t largest = fs.largest_contiguous_free(); 
+    CHECK(fs.free_bytes() > largest); 
+    CHECK(fs.new_file(largest + 1) == FLASHFAT_OUT_OF_SPACE); 
+    CHECK(fs.tell() == 0 && fs.write(buffer, 1) == FLASHFAT_WRONG_MODE); 
+    // the largest run fits, writes up to the reserve only program 
+    CHECK(fs.new_file(largest) == FLASHFAT_OK); 
+    uint32_t erases = erase_count(sim); 
+    CHECK(write_pattern(fs, sim, 6, largest)); 
+    CHECK(erase_count(sim) == erases); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 4, 6, largest)); 
+    CHECK(check_pattern(fs, 2, 4, 60000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief A full table survives journal rewrites and a remount 
+ * 
+ * Small tightly packed files, so any FLASH_FAT_MAX_FILE_COUNT fits the chip. Their records fill the journal 
+ * several times over. 
+ */
+static bool test_full_table(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    uint32_t first_sequence, sequence; 
+    {
+        FlashFAT fs; 
+        fs.set_tight_packing(true); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        journal_room(sim, &first_sequence); 
+        for(uint32_t fi = 0; fi < FLASH_FAT_MAX_FILE_COUNT; fi ++){
+            CHECK(fs.new_file() == FLASHFAT_OK); 
+            CHECK(write_pattern(fs, sim, fi, 50 + fi % 200)); 
+            CHECK(fs.close_file() == FLASHFAT_OK); 
+        }
+        CHECK(fs.new_file() == FLASHFAT_MAX_FILE_COUNT_REACHED); 
+        journal_room(sim, &sequence); 
+        CHECK(sequence > first_sequence); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    FlashFAT_file_allocation_table table; 
+    CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+    CHECK(table._num_files == FLASH_FAT_MAX_FILE_COUNT && table._file_close_err == FLASH_FAT_NO_ERROR_FILE); 
+    for(uint32_t fi = 0; fi < FLASH_FAT_MAX_FILE_COUNT; fi ++) CHECK(check_pattern(fs, fi, fi, 50 + fi % 200)); 
+    CHECK(fs.new_file() == FLASHFAT_MAX_FILE_COUNT_REACHED); 
+    // room for one more once the last goes 
+    CHECK(fs.delete_last_file() == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 7, 300)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, FLASH_FAT_MAX_FILE_COUNT - 1, 7, 300)); 
+    CHECK(check_pattern(fs, FLASH_FAT_MAX_FILE_COUNT - 2, FLASH_FAT_MAX_FILE_COUNT - 2, 50 + (FLASH_FAT_MAX_FILE_COUNT - 2) % 200)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief Start page of a file from the table 
+ * 
+ */
+static uint32_t start_page(FlashFAT &fs, uint fi){
+    FlashFAT_file_allocation_table table; 
+    if(fs.get_file_allocation_table(&table) != FLASHFAT_OK || fi >= table._num_files) return 0xFFFFFFFF; 
+    return table._files[fi]._start_page; 
+}
+
+/**
+ * @brief With tight packing a new file starts in the last file's sector, also after a remount 
+ * 
+ * The erased map is gone after the remount, the rest of the sector has to be read back as erased. 
+ */
+static bool test_tight_packing_remount(){
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    FlashFAT_sim sim(config); 
+    uint32_t first; 
+    {
+        FlashFAT fs; 
+        fs.set_tight_packing(true); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 51, 5000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        first = start_page(fs, 0); 
+        CHECK(first % 16 == 0); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 52, 1000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // the page after the first file's 5000 bytes 
+        CHECK(start_page(fs, 1) == first + 20); 
+    }
+    {
+        FlashFAT fs; 
+        fs.set_tight_packing(true); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        uint32_t erases = erase_count(sim); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 53, 500)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // the page after the second file's 1000 bytes, same sector, nothing erased 
+        CHECK(start_page(fs, 2) == first + 24); 
+        CHECK(erase_count(sim) == erases); 
+    }
+    {
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 54, 500)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        // packing off, the next sector 
+        CHECK(start_page(fs, 3) == first + 32); 
+    }
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 51, 5000)); 
+    CHECK(check_pattern(fs, 1, 52, 1000)); 
+    CHECK(check_pattern(fs, 2, 53, 500)); 
+    CHECK(check_pattern(fs, 3, 54, 500)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief A write bigger than the write buffers, with them empty, programs its whole pages from the caller's buffer 
+ * 
+ * The pages are on the chip when write() returns and only the tail is left in the buffer. A write with bytes 
+ * already buffered, and writes of odd sizes, go through the buffers. 
+ */
+static bool test_direct_write(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    const uint32_t first = 11 * 256 + 184; 
+    for(uint i = 0; i < first; i ++) buffer[i] = pattern(51, i); 
+    CHECK(fs.write(buffer, first) == FLASHFAT_OK); 
+    const byte *data = sim.data() + start_page(fs, 0) * 256; 
+    for(uint i = 0; i < 11 * 256; i ++) CHECK(data[i] == pattern(51, i)); 
+    for(uint i = 11 * 256; i < first; i ++) CHECK(data[i] == 0xFF); 
+    // bytes are buffered, this one is staged even though it's long enough 
+    const uint sizes[] = {3000, 1, 7, 300, 692, 2048}; 
+    uint32_t offset = first; 
+    for(uint size : sizes){
+        for(uint i = 0; i < size; i ++) buffer[i] = pattern(51, offset + i); 
+        CHECK(fs.write(buffer, size) == FLASHFAT_OK); 
+        offset += size; 
+        CHECK(fs.tell() == offset); 
+    }
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 51, offset)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+/**
+ * @brief A long file erases aligned 64kB and 32kB blocks inside its run, falling back when the chip lacks them 
+ * 
+ * Runs on a chip with both block sizes, one with only 64kB blocks and one with only sectors. A short file is 
+ * written first so the long one has a neighbour its erases must not reach. 
+ */
+static bool test_block_erase_selection(){
+    for(int chip = 0; chip < 3; chip ++){
+        FlashFAT_sim_config config; 
+        config.capacity = 1 << 20; 
+        if(chip >= 1) config.half_block_erase_us = 0; 
+        if(chip >= 2) config.block_erase_us = 0; 
+        FlashFAT_sim sim(config); 
+        erase_log_device device(&sim); 
+        FlashFAT fs; 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 71, 6000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        settle(fs, sim); 
+        device.clear(); 
+        FlashFAT_sim_stats before = sim.stats(); 
+        const uint32_t length = 400000; 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 72, length)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        FlashFAT_sim_stats after = sim.stats(); 
+        uint32_t blocks = after.block_erases - before.block_erases; 
+        uint32_t half_blocks = after.half_block_erases - before.half_block_erases; 
+        uint32_t sectors = after.sector_erases - before.sector_erases; 
+        CHECK(device.misaligned == 0); 
+        if(chip == 0) CHECK(blocks > 0 && half_blocks > 0); 
+        if(chip == 1) CHECK(blocks > 0 && half_blocks == 0); 
+        if(chip == 2) CHECK(blocks == 0 && half_blocks == 0); 
+        // most of the file goes in blocks where the chip has them 
+        if(chip < 2) CHECK(sectors * 4096 < length / 2); 
+        FlashFAT_file_allocation_table table; 
+        CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        uint32_t first = table._files[1]._start_page >> 4; 
+        uint32_t end = ((table._files[1]._start_page + table._files[1]._page_length) * 256 + table._files[1]._end_offset + 4095) >> 12; 
+        uint32_t before_first = (table._files[0]._start_page * 256 + 6000 + 4095) >> 12; 
+        CHECK(first >= before_first); 
+        // every sector the file holds erased once, nothing of the first file's touched 
+        for(uint32_t sector = 0; sector < 256; sector ++){
+            if(sector >= first && sector < end) CHECK(device.erases[sector] == 1); 
+            if(sector < before_first && sector >= FLASH_FAT_DATA_START / 4096) CHECK(device.erases[sector] == 0); 
+        }
+        CHECK(check_pattern(fs, 0, 71, 6000)); 
+        CHECK(check_pattern(fs, 1, 72, length)); 
+        CHECK(sim.stats().program_conflicts == 0); 
+    }
+    // without erase ahead new_file() erases the first sector itself, a short file at a block boundary gets a sector 
+    for(int remount = 0; remount < 2; remount ++){
+        FlashFAT_sim_config config; 
+        config.capacity = 1 << 20; 
+        FlashFAT_sim sim(config); 
+        erase_log_device device(&sim); 
+        FlashFAT fs; 
+        fs.set_erase_ahead(0); 
+        CHECK(fs.begin(&device) == FLASHFAT_OK); 
+        // fills the data area up to the first 64kB boundary 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 73, FLASH_FAT_BLOCK_SIZE - FLASH_FAT_DATA_START - 1000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        FlashFAT again; 
+        again.set_erase_ahead(0); 
+        FlashFAT &next = remount ? again : fs; 
+        if(remount) CHECK(again.begin(&device) == FLASHFAT_OK); 
+        device.clear(); 
+        FlashFAT_sim_stats before = sim.stats(); 
+        CHECK(next.new_file() == FLASHFAT_OK); 
+        CHECK(start_page(next, 1) == FLASH_FAT_BLOCK_SIZE / 256); 
+        CHECK(write_pattern(next, sim, 74, 100)); 
+        CHECK(next.close_file() == FLASHFAT_OK); 
+        CHECK(sim.stats().block_erases == before.block_erases); 
+        CHECK(sim.stats().half_block_erases == before.half_block_erases); 
+        CHECK(sim.stats().sector_erases == before.sector_erases + 1); 
+        CHECK(device.erases[FLASH_FAT_BLOCK_SIZE / 4096] == 1); 
+        CHECK(check_pattern(next, 0, 73, FLASH_FAT_BLOCK_SIZE - FLASH_FAT_DATA_START - 1000)); 
+        CHECK(check_pattern(next, 1, 74, 100)); 
+    }
+    return true; 
+}
+
+/**
+ * @brief Wear stats show erases below one per sector instead of rounding them away 
+ * 
+ */
+static bool test_wear_stats_groups(){
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 5, 20000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    FlashFAT_wear_stats stats; 
+    CHECK(fs.get_wear_stats(&stats) == FLASHFAT_OK); 
+    // a handful of sector erases, fewer than a group has sectors 
+    CHECK(stats.total_erases > 0 && stats.total_erases < FLASH_FAT_WEAR_GROUP_SECTORS); 
+    CHECK(stats.max_erases > 0); 
+    CHECK(stats.max_erases <= stats.total_erases); 
+    CHECK(stats.min_erases <= stats.max_erases); 
+    CHECK(stats.mean_erases <= stats.max_erases); 
+    return true; 
+}
+
+/**
+ * @brief Random creates, deletes and compaction passes across remounts match a model of the files 
+ * 
+ * Files go in with and without a reserve, the ones without stop short where their run ends. Compaction gets cut 
+ * short by the next operation as often as not, and the background erase keeps running throughout. Every operation 
+ * is followed by a full check of the chip. 
+ */
+static bool test_model_compaction_remount(){
+    FlashFAT_sim_config config; 
+    config.capacity = 512 << 10; 
+    FlashFAT_sim sim(config); 
+    file_model model; 
+    model.count = 0; 
+    uint32_t state = 1; 
+    uint32_t seed = 0; 
+    for(int mount = 0; mount < 8; mount ++){
+        FlashFAT fs; 
+        fs.set_background_erase(true); 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        CHECK(check_model(fs, &model)); 
+        for(int op = 0; op < 40; op ++){
+            uint32_t choice = next_random(&state) % 10; 
+            if(choice < 5 && model.count < 32){
+                uint32_t length = 1 + next_random(&state) * 3 % 40000; 
+                bool reserve = next_random(&state) % 2; 
+                FlashFAT_status_t status = fs.new_file(reserve ? length : 0, reserve && next_random(&state) % 2); 
+                if(status == FLASHFAT_OUT_OF_SPACE){
+                    // make room for the next one 
+                    CHECK(model.count > 0); 
+                    uint fi = next_random(&state) % model.count; 
+                    CHECK(fs.delete_file(fi) == FLASHFAT_OK); 
+                    model_delete(&model, fi); 
+                }
+                else{
+                    CHECK(status == FLASHFAT_OK); 
+                    seed ++; 
+                    uint32_t written = 0; 
+                    while(written < length){
+                        uint chunk = length - written < 1000 ? length - written : 1000; 
+                        for(uint i = 0; i < chunk; i ++) buffer[i] = pattern(seed, written + i); 
+                        status = fs.write(buffer, chunk); 
+                        // without a reserve the file stops where its run does, the refused write leaves nothing 
+                        if(status == FLASHFAT_OUT_OF_SPACE && !reserve) break; 
+                        CHECK(status == FLASHFAT_OK); 
+                        fs.service(); 
+                        sim.advance(500000); 
+                        written += chunk; 
+                    }
+                    CHECK(fs.close_file() == FLASHFAT_OK); 
+                    model_add(&model, seed, written); 
+                }
+            }
+            else if(choice < 8 && model.count > 0){
+                uint fi = next_random(&state) % model.count; 
+                CHECK(fs.delete_file(fi) == FLASHFAT_OK); 
+                model_delete(&model, fi); 
+            }
+            else{
+                // some passes finish, the rest are interrupted by whatever comes next 
+                CHECK(fs.compact() == FLASHFAT_OK); 
+                uint32_t steps = next_random(&state) % 200; 
+                for(uint32_t i = 0; i < steps && fs.is_compacting(); i ++){
+                    CHECK(fs.service() == FLASHFAT_OK); 
+                    // an erase or a program per call 
+                    sim.advance(50000000); 
+                }
+            }
+            CHECK(check_model(fs, &model)); 
+            CHECK(sim.stats().program_conflicts == 0); 
+        }
+    }
+    CHECK(seed > 40); 
+    return true; 
+}
+
+/**
+ * @brief Power lost at any program or erase of a compaction, a checkpointed file and a delete 
+ * 
+ * After the cut the chip has to mount to one of the states between the operations, with the file that was being 
+ * written cut back by at most a checkpoint interval and what the buffers held. It then has to take a new file 
+ * without programming over anything. 
+ */
+static bool test_model_power_cut(){
+    const uint32_t checkpoint = 2048; 
+    const uint32_t length = 30000; 
+    // the checkpoint interval, the write buffers, the write() call in progress and its page 
+    const uint32_t slack = checkpoint + FLASH_FAT_FILE_BUFFER * FLASH_FAT_WRITE_BUFFER_COUNT + 1000 + 256; 
+    FlashFAT_sim_config config; 
+    config.capacity = 256 << 10; 
+    for(long budget = 0; ; budget ++){
+        FlashFAT_sim sim(config); 
+        file_model model; 
+        model.count = 0; 
+        {
+            // the last two files fit the hole the second one leaves 
+            const uint32_t lengths[] = {6000, 20000, 9000, 16000, 7000, 12000}; 
+            FlashFAT fs; 
+            CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+            for(uint32_t i = 0; i < 6; i ++){
+                CHECK(fs.new_file() == FLASHFAT_OK); 
+                CHECK(write_pattern(fs, sim, i, lengths[i])); 
+                CHECK(fs.close_file() == FLASHFAT_OK); 
+                model_add(&model, i, lengths[i]); 
+            }
+            CHECK(fs.delete_file(3) == FLASHFAT_OK); 
+            model_delete(&model, 3); 
+            CHECK(fs.delete_file(1) == FLASHFAT_OK); 
+            model_delete(&model, 1); 
+        }
+        power_cut_device device(&sim, budget); 
+        uint32_t written_at_cut = length; 
+        {
+            FlashFAT fs; 
+            fs.set_background_erase(true); 
+            fs.set_checkpoint(checkpoint, 0); 
+            fs.begin(&device); 
+            fs.compact(); 
+            for(int i = 0; i < 100000 && fs.is_compacting(); i ++){
+                fs.service(); 
+                sim.advance(1000000); 
+            }
+            fs.new_file(); 
+            for(uint32_t offset = 0; offset < length; offset += 1000){
+                if(device.cut() && written_at_cut == length) written_at_cut = offset; 
+                for(uint i = 0; i < 1000; i ++) buffer[i] = pattern(50, offset + i); 
+                fs.write(buffer, 1000); 
+                fs.service(); 
+                sim.advance(500000); 
+            }
+            fs.close_file(); 
+            fs.delete_file(0); 
+            settle(fs, sim); 
+        }
+        sim.wait_until_free(); 
+        FlashFAT fs; 
+        CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+        FlashFAT_file_allocation_table table; 
+        CHECK(fs.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        uint32_t recovered = 0; 
+        if(table._num_files == model.count + 1){
+            // cut while the new file was open or before the delete 
+            uint32_t at_least = written_at_cut > slack ? written_at_cut - slack : 0; 
+            CHECK(check_prefix(fs, model.count, 50, at_least, length, &recovered)); 
+            for(uint i = 0; i < model.count; i ++) CHECK(check_pattern(fs, i, model.seed[i], model.length[i])); 
+            model_add(&model, 50, recovered); 
+        }
+        else if(table._num_files == model.count && check_pattern(fs, 0, model.seed[0], model.length[0])){
+            // cut before the new file made it into the journal 
+            CHECK(written_at_cut < slack); 
+            CHECK(check_model(fs, &model)); 
+        }
+        else{
+            // the delete went through 
+            model_delete(&model, 0); 
+            model_add(&model, 50, length); 
+            CHECK(check_model(fs, &model)); 
+        }
+        // the recovered chip takes new files 
+        fs.set_background_erase(true); 
+        CHECK(fs.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(fs, sim, 60, 20000)); 
+        CHECK(fs.close_file() == FLASHFAT_OK); 
+        model_add(&model, 60, 20000); 
+        settle(fs, sim); 
+        FlashFAT remount; 
+        CHECK(remount.begin(&sim) == FLASHFAT_OK); 
+        CHECK(check_model(remount, &model)); 
+        CHECK(sim.stats().program_conflicts == 0); 
+        if(!device.cut()) break; 
+    }
+    return true; 
+}
+
+#if FLASH_FAT_RING_BUFFER > 0
+/**
+ * @brief enqueue() keeps its bytes in order across many wraps of the ring counters and counts what it refuses 
+ * 
+ * At least every third record of a burst doesn't fit the ring until service() drains it, the refused ones never 
+ * reach the file. 
+ */
+static bool test_ring_wraparound(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    FlashFAT fs; 
+    CHECK(fs.begin(&sim) == FLASHFAT_OK); 
+    CHECK(fs.new_file() == FLASHFAT_OK); 
+    const uint record = 24; 
+    uint32_t queued = 0; 
+    uint32_t refused = 0; 
+    for(uint32_t burst = 0; burst < 400; burst ++){
+        for(uint32_t r = 0; r < 3; r ++){
+            byte data[record]; 
+            for(uint i = 0; i < record; i ++) data[i] = pattern(9, queued + i); 
+            if(fs.enqueue(data, record)) queued += record; 
+            else refused ++; 
+        }
+        // long enough for the flash to take what was queued 
+        CHECK(fs.service() == FLASHFAT_OK); 
+        sim.advance(2000000); 
+        CHECK(fs.service() == FLASHFAT_OK); 
+    }
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    FlashFAT_ring_stats stats; 
+    fs.get_ring_stats(&stats); 
+    CHECK(refused >= 400); 
+    CHECK(stats.overruns == refused); 
+    CHECK(stats.overrun_bytes == refused * record); 
+    CHECK(stats.peak >= 2 * record && stats.peak <= FLASH_FAT_RING_BUFFER); 
+    CHECK(stats.queued == 0); 
+    CHECK(stats.truncated_bytes == 0); 
+    CHECK(queued > 256 * 20); 
+    CHECK(check_pattern(fs, 0, 9, queued)); 
+    return true; 
+}
+#endif
+
+/**
+ * @brief A task reading an old file keeps going while another waits on the erases of a new file's reserve 
+ * 
+ * The file is written on the plain sim first, then the chip is mounted locked with real busy times. The free space 
+ * is dirtied so the reserve really takes a sector erase at a time. 
+ */
+static bool test_reader_during_erase(){
+    FlashFAT_sim_config config; 
+    config.capacity = 1 << 20; 
+    FlashFAT_sim sim(config); 
+    const uint32_t length = 64 << 10; 
+    uint32_t file_end; 
+    {
+        FlashFAT setup; 
+        CHECK(setup.begin(&sim) == FLASHFAT_OK); 
+        CHECK(setup.new_file() == FLASHFAT_OK); 
+        CHECK(write_pattern(setup, sim, 13, length)); 
+        CHECK(setup.close_file() == FLASHFAT_OK); 
+        settle(setup, sim); 
+        FlashFAT_file_allocation_table table; 
+        CHECK(setup.get_file_allocation_table(&table) == FLASHFAT_OK); 
+        file_end = (table._files[0]._start_page + table._files[0]._page_length + 16) / 16 * 4096; 
+    }
+    memset(sim.data() + file_end, 0, config.capacity - file_end); 
+    realtime_device device(&sim); 
+    FlashFAT_locked<FlashFAT_std_lock> fs; 
+    CHECK(fs.begin(&device) == FLASHFAT_OK); 
+    FlashFAT_File file; 
+    CHECK(fs.open_file(0, &file) == FLASHFAT_OK); 
+    std::atomic<uint32_t> reads(0); 
+    std::atomic<bool> bad(false); 
+    std::atomic<bool> stop(false); 
+    std::thread reader([&](){
+        byte chunk[FLASH_FAT_READ_CHUNK]; 
+        for(uint32_t offset = 0; !stop && !bad; offset = (offset + sizeof(chunk)) % length){
+            if(file.pread(offset, chunk, sizeof(chunk)) != sizeof(chunk)) bad = true; 
+            for(uint i = 0; i < sizeof(chunk); i ++) if(chunk[i] != pattern(13, offset + i)) bad = true; 
+            reads ++; 
+        }
+    }); 
+    // 128 sector erases of 10ms, all with the state lock held 
+    std::atomic<bool> writing(true); 
+    FlashFAT_status_t status = FLASHFAT_OK; 
+    std::thread writer([&](){
+        status = fs.new_file(512 << 10); 
+        writing = false; 
+    }); 
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); 
+    uint32_t before = reads; 
+    std::this_thread::sleep_for(std::chrono::milliseconds(400)); 
+    uint32_t during = reads - before; 
+    bool waited = writing; 
+    writer.join(); 
+    stop = true; 
+    reader.join(); 
+    CHECK(status == FLASHFAT_OK); 
+    CHECK(!bad); 
+    CHECK(waited); 
+    // a chunk waits out at most the erase in progress 
+    CHECK(during >= 10); 
+    CHECK(file.close() == FLASHFAT_OK); 
+    CHECK(write_pattern(fs, sim, 14, 4000)); 
+    CHECK(fs.close_file() == FLASHFAT_OK); 
+    CHECK(check_pattern(fs, 0, 13, length)); 
+    CHECK(check_pattern(fs, 1, 14, 4000)); 
+    CHECK(sim.stats().program_conflicts == 0); 
+    return true; 
+}
+
+typedef struct{
+    const char *name;       ///< Printed name 
+    bool (*run)();          ///< Test, false on failure 
+}   test_case; 
+
+static const test_case tests[] = {
+    {"spare range erased map", test_spare_range_erased_map}, 
+    {"legacy migration", test_legacy_migration}, 
+    {"legacy migration power cut", test_legacy_migration_power_cut}, 
+    {"legacy no space", test_legacy_no_space}, 
+    {"capacity clamped", test_capacity_clamped}, 
+    {"begin table write failure", test_begin_table_write_failure}, 
+    {"begin recovery failure", test_begin_recovery_failure}, 
+    {"torn progress record", test_torn_progress_record}, 
+    {"torn wear record", test_torn_wear_record}, 
+    {"torn erased record", test_torn_erased_record}, 
+    {"close record failure", test_close_record_failure}, 
+    {"checkpoint policy", test_checkpoint_policy}, 
+    {"read wrong mode", test_read_wrong_mode}, 
+    {"seek pread", test_seek_pread}, 
+    {"continuous read", test_continuous_read}, 
+    {"handles side by side", test_handles_side_by_side}, 
+    {"handles not left stale", test_handles_not_left_stale}, 
+    {"handles block delete and compaction", test_handles_block_delete_and_compaction}, 
+    {"service never blocks", test_service_never_blocks}, 
+    {"erase ahead idle", test_erase_ahead_idle}, 
+    {"space after holes", test_space_after_holes}, 
+    {"table cache", test_table_cache}, 
+    {"full table", test_full_table}, 
+    {"new file reserve", test_new_file_reserve}, 
+    {"tight packing remount", test_tight_packing_remount}, 
+    {"direct write", test_direct_write}, 
+    {"block erase selection", test_block_erase_selection}, 
+    {"wear stats groups", test_wear_stats_groups}, 
+    {"model compaction remount", test_model_compaction_remount}, 
+    {"model power cut", test_model_power_cut}, 
+    {"reader during erase", test_reader_during_erase}, 
+#if FLASH_FAT_RING_BUFFER > 0
+    {"ring wraparound", test_ring_wraparound}, 
+#endif
+};
+
+int main(){
+    int failed = 0; 
+    for(uint i = 0; i < sizeof(tests) / sizeof(tests[0]); i ++){
+        bool ok = tests[i].run(); 
+        printf("%s %s\n", ok ? "pass" : "FAIL", tests[i].name); 
+        if(!ok) failed ++; 
+    }
+    printf("%d of %d failed\n", failed, (int)(sizeof(tests) / sizeof(tests[0]))); 
+    return failed != 0; 
+}